@@ -0,0 +1,169 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Stat packing, libixp against statpack.c.
+ *
+ * Packs the same directory's worth of records both ways, the way the
+ * handlers used to (fill an IxpStat, ixp_sizeof_stat, ixp_pstat) and
+ * the way they do now (stat_text, stat_pack), checks that the bytes
+ * agree and prints the time per record for each. Fails if the direct
+ * way is the slower. Run with `make bench`, optionally with a record
+ * count and a round count. */
+
+enum { MAXREC = 4096 };
+
+typedef struct Rec {
+    struct stat st;
+    char name[64];
+    char target[128];
+} Rec;
+
+static Rec recs[MAXREC];
+static char out_ixp[MAXREC * 512], out_direct[MAXREC * 512];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_recs(int n) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        Rec *r = &recs[i];
+
+        memset(&r->st, 0, sizeof(r->st));
+        r->st.st_ino = 1000003u * (i + 1);
+        r->st.st_uid = 1000;
+        r->st.st_gid = 100 + i % 3;
+        r->st.st_size = (off_t)i * 4099;
+        r->st.st_atime = 1700000000 + i;
+        r->st.st_mtime = 1700000000 + 2 * i;
+        snprintf(r->name, sizeof(r->name), "entry-%d.%s", i, i % 2 ? "txt" : "data");
+        r->target[0] = '\0';
+        switch(i % 8) {
+        case 0:
+            r->st.st_mode = S_IFDIR | 0755;
+            break;
+        case 7:
+            r->st.st_mode = S_IFLNK | 0777;
+            snprintf(r->target, sizeof(r->target), "../somewhere/else/%d", i);
+            break;
+        default:
+            r->st.st_mode = S_IFREG | 0644;
+        }
+    }
+}
+
+/* What build_stat and entry_stat used to do */
+static size_t pack_ixp(int version, int n, const char *user) {
+    IxpMsg m = ixp_message(out_ixp, sizeof(out_ixp), MsgPack);
+    IxpStat s;
+    int i;
+
+    m.version = version;
+    for(i = 0; i < n; i++) {
+        Rec *r = &recs[i];
+        struct stat *st = &r->st;
+        int lnk = S_ISLNK(st->st_mode);
+
+        memset(&s, 0, sizeof(s));
+        s.name = r->name;
+        s.uid = s.gid = s.muid = (char *)user;
+        s.extension = lnk ? r->target : "";
+        s.qid.type = S_ISDIR(st->st_mode) ? P9_QTDIR : lnk ? P9_QTSYMLINK : P9_QTFILE;
+        s.qid.path = st->st_ino;
+        s.qid.version = st->st_mtime;
+        s.mode = (st->st_mode & 0777) | (S_ISDIR(st->st_mode) ? P9_DMDIR : 0) | (lnk ? P9_DMSYMLINK : 0);
+        s.atime = st->st_atime;
+        s.mtime = st->st_mtime;
+        s.length = lnk ? strlen(r->target) : (uint64_t)st->st_size;
+        s.n_uid = st->st_uid;
+        s.n_gid = st->st_gid;
+        s.n_muid = st->st_uid;
+        if((size_t)(m.pos - out_ixp) + ixp_sizeof_stat(&s, version) > sizeof(out_ixp))
+            break;
+        ixp_pstat(&m, &s);
+    }
+    return m.pos - out_ixp;
+}
+
+static size_t pack_direct(int version, int n, const char *user) {
+    const StatFormat *fmt = stat_format(version);
+    StatText t;
+    size_t used = 0, len;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        Rec *r = &recs[i];
+
+        stat_text(&t, r->name, user, user, S_ISLNK(r->st.st_mode) ? r->target : nil);
+        if(!(len = stat_pack(fmt, out_direct + used, sizeof(out_direct) - used, &r->st, &t)))
+            break;
+        used += len;
+    }
+    return used;
+}
+
+static int run(const char *label, int version, int n, int rounds) {
+    uint64_t t0, t_ixp, t_direct;
+    size_t a = 0, b = 0;
+    int i;
+
+    a = pack_ixp(version, n, "glenda");
+    b = pack_direct(version, n, "glenda");
+    if(a != b || memcmp(out_ixp, out_direct, a) != 0) {
+        fprintf(stderr, "%s: records differ (%zu bytes from libixp, %zu direct)\n", label, a, b);
+        return -1;
+    }
+
+    t0 = now_ns();
+    for(i = 0; i < rounds; i++)
+        a += pack_ixp(version, n, "glenda");
+    t_ixp = now_ns() - t0;
+    t0 = now_ns();
+    for(i = 0; i < rounds; i++)
+        b += pack_direct(version, n, "glenda");
+    t_direct = now_ns() - t0;
+
+    printf("%-10s libixp %7.1f ns/record, direct %7.1f ns/record, %.2fx\n", label,
+           (double)t_ixp / ((double)n * rounds), (double)t_direct / ((double)n * rounds),
+           t_direct ? (double)t_ixp / t_direct : 0.0);
+    if(t_direct > t_ixp) {
+        fprintf(stderr, "%s: direct packing is slower than libixp\n", label);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    int version, plain = -1, dotu = -1;
+    int ret = 0;
+
+    if(n < 1 || n > MAXREC || rounds < 1) {
+        fprintf(stderr, "usage: %s [records (max %d)] [rounds]\n", argv[0], MAXREC);
+        return 2;
+    }
+    make_recs(n);
+
+    /* libixp numbers its dialects itself; find one of each */
+    for(version = 0; version < 8 && (plain < 0 || dotu < 0); version++) {
+        if(stat_format(version)->dotu) {
+            if(dotu < 0)
+                dotu = version;
+        } else if(plain < 0)
+            plain = version;
+    }
+    if(plain >= 0 && run("9P2000", plain, n, rounds) < 0)
+        ret = 1;
+    if(dotu >= 0 && run("9P2000.u", dotu, n, rounds) < 0)
+        ret = 1;
+    return ret;
+}
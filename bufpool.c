@@ -0,0 +1,147 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Reusable buffers for Rread and Rstat payloads.
+ *
+ * libixp frees the payload of every reply once it has been sent. Its
+ * request.c is built with free() pointing at buf_free (see the
+ * Makefile), so buffers that came from here go back on a free list
+ * rather than to the allocator, and anything else is passed through to
+ * free().
+ *
+ * Payloads run from a 60-byte stat to a whole message, so buffers come
+ * in power-of-two size classes from CLASS_MIN up to the message size.
+ * Each class is carved on demand from its own equal slice of a single
+ * reserved region, so telling ours apart, and which class one is, is
+ * arithmetic on the address. The thread that replies is nearly always
+ * the one that allocated, so each thread keeps a few buffers of each
+ * class and only touches the shared lists when those run dry or
+ * overflow. */
+
+enum {
+    CLASS_BYTES = 32 << 20, /* Address space reserved for each class */
+    CLASS_MIN = 512,        /* Smallest buffer handed out */
+    CLASSES = 24,           /* Most classes; enough for any msize */
+    LOCAL_MAX = 8,          /* Buffers of a class a thread keeps */
+};
+
+typedef struct FreeBuf FreeBuf;
+struct FreeBuf {
+    FreeBuf *next;
+};
+
+typedef struct BufClass {
+    char *next, *end;       /* Not yet carved out of this class's slice */
+    FreeBuf *shared;
+} BufClass;
+
+static char *arena, *arena_end;
+static size_t slice;
+static int nclass;
+static BufClass classes[CLASSES];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread FreeBuf *local[CLASSES];
+static __thread int nlocal[CLASSES];
+
+static unsigned long hits, misses;
+
+static size_t class_size(int c) {
+    return (size_t)CLASS_MIN << c;
+}
+
+/* Reserve room for buffers of up to size bytes. Without it every
+ * allocation just falls through to malloc. */
+int bufpool_init(size_t size) {
+    int c;
+
+    for(nclass = 1; class_size(nclass - 1) < size; nclass++)
+        if(nclass == CLASSES)
+            return -1;
+    slice = CLASS_BYTES;
+    if(slice < 16 * class_size(nclass - 1))
+        slice = 16 * class_size(nclass - 1);
+    arena = mmap(nil, nclass * slice, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(arena == MAP_FAILED) {
+        arena = nil;
+        return -1;
+    }
+    arena_end = arena + nclass * slice;
+    for(c = 0; c < nclass; c++) {
+        classes[c].next = arena + c * slice;
+        classes[c].end = classes[c].next + slice / class_size(c) * class_size(c);
+    }
+    return 0;
+}
+
+/* A buffer of at least n bytes, to be released with buf_free (or by
+ * libixp after the reply) */
+void *buf_alloc(size_t n) {
+    FreeBuf *b = nil;
+    BufClass *k;
+    int c;
+
+    for(c = 0; arena && c < nclass && class_size(c) < n; c++)
+        ;
+    if(arena && c < nclass) {
+        k = &classes[c];
+        if((b = local[c])) {
+            local[c] = b->next;
+            nlocal[c]--;
+        } else {
+            pthread_mutex_lock(&pool_lock);
+            if((b = k->shared))
+                k->shared = b->next;
+            else if(k->next < k->end) {
+                b = (FreeBuf *)k->next;
+                k->next += class_size(c);
+            }
+            pthread_mutex_unlock(&pool_lock);
+        }
+        if(b) {
+            __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+            return b;
+        }
+    }
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    return malloc(n ? n : 1);
+}
+
+void buf_free(void *p) {
+    FreeBuf *b = p;
+    int c;
+
+    if((char *)p < arena || (char *)p >= arena_end) {
+        free(p);
+        return;
+    }
+    c = ((char *)p - arena) / slice;
+    if(nlocal[c] < LOCAL_MAX) {
+        b->next = local[c];
+        local[c] = b;
+        nlocal[c]++;
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    b->next = classes[c].shared;
+    classes[c].shared = b;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void bufpool_report(void) {
+    unsigned long made = 0;
+    int c;
+
+    for(c = 0; arena && c < nclass; c++)
+        made += (classes[c].next - (arena + c * slice)) / class_size(c);
+    fprintf(stderr, "bufpool: %lu hits, %lu misses, %lu buffers made in %d classes of %lu to %lu bytes\n",
+            __atomic_load_n(&hits, __ATOMIC_RELAXED),
+            __atomic_load_n(&misses, __ATOMIC_RELAXED),
+            made, arena ? nclass : 0,
+            (unsigned long)CLASS_MIN,
+            arena ? (unsigned long)class_size(nclass - 1) : 0UL);
+}
@@ -0,0 +1,221 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Packed directory images.
+ *
+ * A hot directory's whole Rread stream is kept as one blob, so reading
+ * it again is a copy from memory rather than a getdents and a stat per
+ * entry. An image is good for as long as the directory has the same
+ * inode, mtime and ctime. Entries changing in place don't touch the
+ * directory, so images are also forgotten along with the metadata cache,
+ * and without a complete set of inotify watches they only last the
+ * metadata TTL.
+ *
+ * Images are shared: a fid listing a directory holds a reference to the
+ * image it started with, so eviction never pulls one out from under a
+ * read. The total size of the cached images is capped at dc_limit.
+ *
+ * A directory too big for an image gets an empty one marked big
+ * instead, good on the same terms, so that every listing of it doesn't
+ * read and stat its first dc_room() bytes' worth only to give up. */
+
+enum { DC_BUCKETS = 256 };
+
+size_t dc_limit = 16 << 20;
+
+static pthread_mutex_t dc_lock = PTHREAD_MUTEX_INITIALIZER;
+static DirImage *buckets[DC_BUCKETS];
+static DirImage lru = { .prev = &lru, .next = &lru };
+static size_t total;
+static int count;
+
+static unsigned long hits, misses, evictions;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned bucket(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while(*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h % DC_BUCKETS;
+}
+
+static int same_dir(DirImage *img, struct stat *st) {
+    return img->dev == st->st_dev && img->ino == st->st_ino &&
+           img->mtime.tv_sec == st->st_mtim.tv_sec && img->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           img->ctime.tv_sec == st->st_ctim.tv_sec && img->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Called with dc_lock held */
+static void unref(DirImage *img) {
+    if(--img->refs == 0) {
+        free(img->path);
+        free(img);
+    }
+}
+
+/* Called with dc_lock held: take img out of the cache */
+static void drop(DirImage *img) {
+    DirImage **ip;
+
+    for(ip = &buckets[bucket(img->path)]; *ip; ip = &(*ip)->hnext) {
+        if(*ip == img) {
+            *ip = img->hnext;
+            break;
+        }
+    }
+    img->prev->next = img->next;
+    img->next->prev = img->prev;
+    total -= img->len;
+    count--;
+    unref(img);
+}
+
+/* Largest image worth building; 0 when the cache is off. Images go
+ * stale on the same terms as the metadata cache, so they need it on. */
+size_t dc_room(void) {
+    return md_active() ? dc_limit / 4 : 0;
+}
+
+/* A reference to the cached image of the directory at path, if it is
+ * still good for st */
+DirImage *dc_lookup(const char *path, int version, struct stat *st) {
+    DirImage *img;
+
+    if(!dc_limit || md_writing_in(path))
+        return nil;
+    pthread_mutex_lock(&dc_lock);
+    for(img = buckets[bucket(path)]; img; img = img->hnext) {
+        if(img->version == version && strcmp(img->path, path) == 0)
+            break;
+    }
+    if(img && (!same_dir(img, st) ||
+               (!watch_complete() && now_ms() - img->built >= (uint64_t)md_ttl))) {
+        drop(img);
+        img = nil;
+    }
+    if(img) {
+        img->prev->next = img->next;
+        img->next->prev = img->prev;
+        img->next = lru.next;
+        img->prev = &lru;
+        lru.next->prev = img;
+        lru.next = img;
+        img->refs++;
+        hits++;
+    } else
+        misses++;
+    pthread_mutex_unlock(&dc_lock);
+    return img;
+}
+
+/* Cache a freshly built image of the directory at path. st is the
+ * directory as it was before the build started, and gen the md_gen from
+ * then; if anything was forgotten since, the image may be stale and is
+ * only handed back to the caller. Returns a reference for the caller,
+ * or nil, with img freed, when out of memory. */
+DirImage *dc_insert(DirImage *img, const char *path, int version, struct stat *st, unsigned gen) {
+    DirImage *old, **ip;
+
+    if(!(img->path = strdup(path))) {
+        free(img);
+        return nil;
+    }
+    img->version = version;
+    img->dev = st->st_dev;
+    img->ino = st->st_ino;
+    img->mtime = st->st_mtim;
+    img->ctime = st->st_ctim;
+    img->built = now_ms();
+    img->refs = 1;
+
+    pthread_mutex_lock(&dc_lock);
+    if(!md_fresh(path, gen) || md_writing_in(path)) {
+        pthread_mutex_unlock(&dc_lock);
+        return img;
+    }
+    img->refs++;    /* The cache's */
+    for(ip = &buckets[bucket(path)]; (old = *ip); ip = &old->hnext) {
+        if(old->version == version && strcmp(old->path, path) == 0) {
+            drop(old);
+            break;
+        }
+    }
+    img->hnext = buckets[bucket(path)];
+    buckets[bucket(path)] = img;
+    img->next = lru.next;
+    img->prev = &lru;
+    lru.next->prev = img;
+    lru.next = img;
+    total += img->len;
+    count++;
+    while(total > dc_limit && lru.prev != img) {
+        drop(lru.prev);
+        evictions++;
+    }
+    pthread_mutex_unlock(&dc_lock);
+    return img;
+}
+
+void dc_put(DirImage *img) {
+    if(!img)
+        return;
+    pthread_mutex_lock(&dc_lock);
+    unref(img);
+    pthread_mutex_unlock(&dc_lock);
+}
+
+/* Called with dc_lock held: drop every image of the directory at path */
+static void drop_path(const char *path) {
+    DirImage *img, *next;
+
+    for(img = buckets[bucket(path)]; img; img = next) {
+        next = img->hnext;
+        if(strcmp(img->path, path) == 0)
+            drop(img);
+    }
+}
+
+/* path changed: its own listing and its directory's are stale, and with
+ * MD_TREE so is everything below it. Only that needs a look at every
+ * image; the rest are found by path. */
+void dc_forget(const char *path, int flags) {
+    DirImage *img, *next;
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t plen = slash == path ? 1 : (size_t)(slash - path);
+    size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+
+    if(!dc_limit)
+        return;
+    pthread_mutex_lock(&dc_lock);
+    drop_path(path);
+    if(slash && plen < sizeof(parent)) {
+        memcpy(parent, path, plen);
+        parent[plen] = '\0';
+        drop_path(parent);
+    }
+    for(img = lru.next; (flags & MD_TREE) && img != &lru; img = next) {
+        next = img->next;
+        if(strncmp(img->path, path, len) == 0 && img->path[len] == '/')
+            drop(img);
+    }
+    pthread_mutex_unlock(&dc_lock);
+}
+
+void dc_report(void) {
+    pthread_mutex_lock(&dc_lock);
+    fprintf(stderr, "dircache: %lu hits, %lu misses, %lu evictions, %d images, %zu of %zu bytes\n",
+            hits, misses, evictions, count, total, dc_limit);
+    pthread_mutex_unlock(&dc_lock);
+}
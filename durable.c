@@ -0,0 +1,226 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/* When written data is made durable.
+ *
+ * DUR_NONE leaves it to the kernel's writeback, as before.
+ *
+ * DUR_CLUNK fdatasyncs a file when a fid that wrote to it is clunked,
+ * and a Tclunk that can't sync gets the error.
+ *
+ * DUR_GROUP holds each Rwrite back until its data is on disk. Writes
+ * are handed to a committer thread instead of waiting on a sync of
+ * their own, and it syncs each fid's file once for all the writes queued
+ * since its last round. While one round is on the disk the next one gathers,
+ * so a busy file costs one fdatasync per disk flush rather than one per
+ * write. dur_interval sets how long a round waits for company before it
+ * starts, bounding the extra latency of a write.
+ *
+ * New directory entries are synced in both modes that sync at all. */
+
+typedef struct Commit Commit;
+struct Commit {
+    Ixp9Req *r;
+    FidState *state;
+    Ixp9Req *flush;     /* Tflush waiting for this reply */
+    int err;
+    Commit *next;
+};
+
+int dur_mode = DUR_NONE;
+int dur_interval = 0;       /* ms */
+
+static pthread_mutex_t dur_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dur_cond = PTHREAD_COND_INITIALIZER;     /* Queue grew */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;    /* Round ended */
+static Commit *queue, **queue_tail = &queue;
+static Commit *syncing;     /* The round on the disk now */
+
+static unsigned long writes, syncs, rounds;
+
+/* Called from the Twrite handler once the data is written. In group
+ * mode takes over the reply and returns 0; otherwise returns -1 and the
+ * caller replies. */
+int dur_defer(Ixp9Req *r, FidState *state) {
+    Commit *c;
+
+    if(dur_mode != DUR_GROUP)
+        return -1;
+    if(!(c = calloc(1, sizeof(Commit)))) {
+        /* Can't queue it, so sync it here */
+        if(fdatasync(state->fd) < 0) {
+            ixp_respond(r, strerror(errno));
+            return 0;
+        }
+        return -1;
+    }
+    c->r = r;
+    c->state = state;
+    pthread_mutex_lock(&dur_lock);
+    state->commits++;
+    *queue_tail = c;
+    queue_tail = &c->next;
+    pthread_cond_signal(&dur_cond);
+    pthread_mutex_unlock(&dur_lock);
+    return 0;
+}
+
+/* The fid has written something a clunk-mode Tclunk must sync */
+void dur_wrote(FidState *state) {
+    if(dur_mode == DUR_CLUNK)
+        __atomic_store_n(&state->dirty, 1, __ATOMIC_RELAXED);
+}
+
+/* Sync every file in the round once, sharing the result among its
+ * writes */
+static void commit_round(Commit *round) {
+    Commit *c, *d;
+
+    for(c = round; c; c = c->next) {
+        for(d = round; d != c; d = d->next) {
+            if(d->state == c->state)
+                break;
+        }
+        if(d != c) {
+            c->err = d->err;
+            continue;
+        }
+        c->err = fdatasync(c->state->fd) < 0 ? errno : 0;
+        __atomic_add_fetch(&syncs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *committer(void *arg) {
+    struct timespec until;
+    Commit *round, *c, *next;
+    Ixp9Req *flush;
+
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&dur_lock);
+        while(!queue)
+            pthread_cond_wait(&dur_cond, &dur_lock);
+        if(dur_interval > 0) {
+            /* Give other writers a moment to join the round */
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += dur_interval * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            while(pthread_cond_timedwait(&dur_cond, &dur_lock, &until) != ETIMEDOUT)
+                ;
+        }
+        round = syncing = queue;
+        queue = nil;
+        queue_tail = &queue;
+        pthread_mutex_unlock(&dur_lock);
+
+        commit_round(round);
+
+        for(c = round; c; c = next) {
+            next = c->next;
+            ixp_respond(c->r, c->err ? strerror(c->err) : nil);
+            pthread_mutex_lock(&dur_lock);
+            flush = c->flush;
+            c->state->commits--;
+            pthread_cond_broadcast(&done_cond);
+            pthread_mutex_unlock(&dur_lock);
+            /* The flushed request has had its reply; now the Rflush can go */
+            if(flush)
+                ixp_respond(flush, nil);
+            __atomic_add_fetch(&writes, 1, __ATOMIC_RELAXED);
+            free(c);
+        }
+        pthread_mutex_lock(&dur_lock);
+        syncing = nil;
+        pthread_mutex_unlock(&dur_lock);
+        __atomic_add_fetch(&rounds, 1, __ATOMIC_RELAXED);
+    }
+    return nil;
+}
+
+/* Tflush for a write waiting on a commit. Returns 1 if it was found;
+ * the Rflush then goes out after the write's own reply. */
+int dur_flush(Ixp9Req *r) {
+    Commit *c;
+    int found = 0;
+
+    if(dur_mode != DUR_GROUP)
+        return 0;
+    pthread_mutex_lock(&dur_lock);
+    for(c = syncing; c && !found; c = c->next) {
+        if(c->r == r->oldreq && !c->flush) {
+            c->flush = r;
+            found = 1;
+        }
+    }
+    for(c = queue; c && !found; c = c->next) {
+        if(c->r == r->oldreq && !c->flush) {
+            c->flush = r;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&dur_lock);
+    return found;
+}
+
+/* Wait for the fid's writes to be committed before its descriptor
+ * closes */
+void dur_drain(FidState *state) {
+    pthread_mutex_lock(&dur_lock);
+    while(state->commits > 0)
+        pthread_cond_wait(&done_cond, &dur_lock);
+    pthread_mutex_unlock(&dur_lock);
+}
+
+/* Tclunk in clunk mode: sync what the fid wrote. Returns -1 with errno
+ * set on failure. */
+int dur_clunk(FidState *state) {
+    if(dur_mode != DUR_CLUNK || state->fd < 0 || !__atomic_load_n(&state->dirty, __ATOMIC_RELAXED))
+        return 0;
+    __atomic_store_n(&state->dirty, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&syncs, 1, __ATOMIC_RELAXED);
+    return fdatasync(state->fd);
+}
+
+/* A name was just added to or removed from the directory dirfd (which
+ * may be an O_PATH descriptor) */
+void dur_dir(int dirfd) {
+    int fd;
+
+    if(dur_mode == DUR_NONE)
+        return;
+    if((fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+int dur_start(void) {
+    pthread_t tid;
+
+    if(dur_mode != DUR_GROUP)
+        return 0;
+    if(pthread_create(&tid, nil, committer, nil) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void dur_report(void) {
+    static const char *modes[] = { "none", "clunk", "group" };
+
+    if(dur_mode == DUR_NONE)
+        return;
+    fprintf(stderr, "durable: %s, %lu writes committed, %lu syncs, %lu rounds\n",
+            modes[dur_mode],
+            __atomic_load_n(&writes, __ATOMIC_RELAXED),
+            __atomic_load_n(&syncs, __ATOMIC_RELAXED),
+            __atomic_load_n(&rounds, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,275 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Contents of small files.
+ *
+ * Files no bigger than fc_max that are opened for reading are read in
+ * whole at Topen and kept, keyed by device, inode, mtime and size, so
+ * that every open of an unchanged file shares one copy and its Treads
+ * are answered from memory. The total is capped at fc_limit, least
+ * recently used going first.
+ *
+ * A fid keeps the copy it opened with. Before each read the copy is
+ * checked against the file's current metadata, which comes from the
+ * metadata cache when it can, so a hit needs no system call at all.
+ * Whatever md_forget forgets is also marked stale here, as mtime alone
+ * can miss a rewrite that lands in the same clock tick. */
+
+enum { FC_BUCKETS = 1024 };
+
+size_t fc_limit = 0;
+size_t fc_max = 64 << 10;
+
+static pthread_mutex_t fc_lock = PTHREAD_MUTEX_INITIALIZER;
+static FileImage *buckets[FC_BUCKETS];    /* By inode */
+static FileImage *pbuckets[FC_BUCKETS];   /* By path */
+static FileImage lru = { .prev = &lru, .next = &lru };
+static size_t total;
+static int count;
+
+static unsigned long hits, misses, evictions, served;
+
+static unsigned bucket(dev_t dev, ino_t ino) {
+    return (unsigned)((ino * 2654435761u) ^ dev) % FC_BUCKETS;
+}
+
+static unsigned pbucket(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while(*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h % FC_BUCKETS;
+}
+
+static int same_file(FileImage *img, struct stat *st) {
+    return img->dev == st->st_dev && img->ino == st->st_ino &&
+           img->mtime.tv_sec == st->st_mtim.tv_sec && img->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           img->len == (size_t)st->st_size;
+}
+
+/* Called with fc_lock held */
+static void unref(FileImage *img) {
+    if(--img->refs == 0) {
+        free(img->path);
+        free(img);
+    }
+}
+
+/* Called with fc_lock held: take img out of the cache */
+static void drop(FileImage *img) {
+    FileImage **ip;
+
+    for(ip = &buckets[bucket(img->dev, img->ino)]; *ip; ip = &(*ip)->hnext) {
+        if(*ip == img) {
+            *ip = img->hnext;
+            break;
+        }
+    }
+    for(ip = &pbuckets[pbucket(img->path)]; *ip; ip = &(*ip)->pnext) {
+        if(*ip == img) {
+            *ip = img->pnext;
+            break;
+        }
+    }
+    img->prev->next = img->next;
+    img->next->prev = img->prev;
+    total -= img->len;
+    count--;
+    unref(img);
+}
+
+/* Called with fc_lock held */
+static void touch(FileImage *img) {
+    img->prev->next = img->next;
+    img->next->prev = img->prev;
+    img->next = lru.next;
+    img->prev = &lru;
+    lru.next->prev = img;
+    lru.next = img;
+}
+
+/* Read the whole of the file the fid just opened at path, if it is
+ * still the file st describes */
+static FileImage *load(FidState *state, const char *path, struct stat *st) {
+    FileImage *img;
+    struct stat now;
+    ssize_t n;
+
+    if(!(img = malloc(sizeof(FileImage) + st->st_size + 1)))
+        return nil;
+    /* Ask for a byte more to see whether it grew */
+    n = pread(state->fd, img->data, st->st_size + 1, 0);
+    if(n != st->st_size || fstat(state->fd, &now) < 0 ||
+       now.st_ino != st->st_ino || now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+       now.st_mtim.tv_nsec != st->st_mtim.tv_nsec || now.st_size != st->st_size) {
+        free(img);
+        return nil;
+    }
+    if(!(img->path = strdup(path))) {
+        free(img);
+        return nil;
+    }
+    img->dev = st->st_dev;
+    img->ino = st->st_ino;
+    img->mtime = st->st_mtim;
+    img->len = st->st_size;
+    img->stale = 0;
+    return img;
+}
+
+/* The contents for a fid just opened for reading on the file st
+ * describes, or nil when it isn't worth caching. Returns a reference. */
+FileImage *fc_open(FidState *state, struct stat *st) {
+    FileImage *img, *old, **ip;
+    unsigned b = bucket(st->st_dev, st->st_ino);
+    unsigned gen;
+    char path[PATH_MAX];
+
+    if(!fc_limit || !S_ISREG(st->st_mode) || (size_t)st->st_size > fc_max ||
+       path_str(state->path, path, sizeof(path)) < 0 || md_writing(path))
+        return nil;
+
+    pthread_mutex_lock(&fc_lock);
+    for(img = buckets[b]; img; img = img->hnext) {
+        if(img->dev == st->st_dev && img->ino == st->st_ino)
+            break;
+    }
+    if(img && !img->stale && same_file(img, st)) {
+        touch(img);
+        img->refs++;
+        hits++;
+        pthread_mutex_unlock(&fc_lock);
+        return img;
+    }
+    misses++;
+    pthread_mutex_unlock(&fc_lock);
+
+    gen = md_gen();
+    if(!(img = load(state, path, st)))
+        return nil;
+    img->refs = 2;  /* The cache's and the fid's */
+
+    pthread_mutex_lock(&fc_lock);
+    /* It may have been forgotten while we read */
+    if(!md_fresh(img->path, gen)) {
+        pthread_mutex_unlock(&fc_lock);
+        free(img->path);
+        free(img);
+        return nil;
+    }
+    for(ip = &buckets[b]; (old = *ip); ip = &old->hnext) {
+        if(old->dev == img->dev && old->ino == img->ino) {
+            drop(old);
+            break;
+        }
+    }
+    img->hnext = buckets[b];
+    buckets[b] = img;
+    img->pnext = pbuckets[pbucket(img->path)];
+    pbuckets[pbucket(img->path)] = img;
+    img->prev = img->next = img;
+    touch(img);
+    total += img->len;
+    count++;
+    while(total > fc_limit && lru.prev != img) {
+        drop(lru.prev);
+        evictions++;
+    }
+    pthread_mutex_unlock(&fc_lock);
+    return img;
+}
+
+void fc_put(FileImage *img) {
+    if(!img)
+        return;
+    pthread_mutex_lock(&fc_lock);
+    unref(img);
+    pthread_mutex_unlock(&fc_lock);
+}
+
+/* Answer a Tread from the fid's copy of the file, if it still matches.
+ * With block clear nothing may touch the filesystem, so a metadata
+ * cache miss falls back too. Returns -1 to have the caller read. */
+int fc_read(Ixp9Req *r, FidState *state, int block) {
+    FileImage *img = state->content;
+    uint64_t offset = r->ifcall.tread.offset;
+    uint32_t count = read_count(r);
+    struct stat st;
+    char path[PATH_MAX], *buf;
+
+    if(!img || __atomic_load_n(&img->stale, __ATOMIC_ACQUIRE) ||
+       path_str(state->path, path, sizeof(path)) < 0 || md_writing(path))
+        return -1;
+    if((block ? md_stat(state->dirfd, path, &st) : md_get(path, &st)) < 0)
+        return -1;
+    if(!same_file(img, &st)) {
+        __atomic_store_n(&img->stale, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    if(offset > img->len)
+        offset = img->len;
+    if(count > img->len - offset)
+        count = img->len - offset;
+    if(!(buf = buf_alloc(count)))
+        return -1;
+    memcpy(buf, img->data + offset, count);
+    r->ofcall.rread.count = count;
+    r->ofcall.rread.data = buf;
+    __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+    ixp_respond(r, nil);
+    return 0;
+}
+
+/* Tread straight from the event loop. The fid is only borrowed if no
+ * worker is changing it. */
+int fc_serve(Ixp9Req *r) {
+    FidState *state = r->fid->aux;
+    int ret = -1;
+
+    /* Data buffered for the file by another fid needs a worker to flush */
+    if(!fc_limit || !state || r->fid->qid.type != P9_QTFILE || wb_pending())
+        return -1;
+    if(pthread_rwlock_tryrdlock(&state->lock) != 0)
+        return -1;
+    if(state->content)
+        ret = fc_read(r, state, 0);
+    pthread_rwlock_unlock(&state->lock);
+    return ret;
+}
+
+/* path changed, and with MD_TREE everything below it */
+void fc_forget(const char *path, int flags) {
+    FileImage *img, *next;
+    size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+
+    if(!fc_limit)
+        return;
+    pthread_mutex_lock(&fc_lock);
+    for(img = pbuckets[pbucket(path)]; img; img = next) {
+        next = img->pnext;
+        if(strcmp(img->path, path) == 0) {
+            __atomic_store_n(&img->stale, 1, __ATOMIC_RELEASE);
+            drop(img);
+        }
+    }
+    for(img = lru.next; (flags & MD_TREE) && img != &lru; img = next) {
+        next = img->next;
+        if(strncmp(img->path, path, len) == 0 && img->path[len] == '/') {
+            __atomic_store_n(&img->stale, 1, __ATOMIC_RELEASE);
+            drop(img);
+        }
+    }
+    pthread_mutex_unlock(&fc_lock);
+}
+
+void fc_report(void) {
+    pthread_mutex_lock(&fc_lock);
+    fprintf(stderr, "filecache: %lu hits, %lu misses, %lu evictions, %lu reads served, %d files, %zu of %zu bytes\n",
+            hits, misses, evictions, __atomic_load_n(&served, __ATOMIC_RELAXED), count, total, fc_limit);
+    pthread_mutex_unlock(&fc_lock);
+}
@@ -6,154 +6,566 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
-void read_directory(Ixp9Req *r, const char *fullpath) {
-    DIR *dir = opendir(fullpath);
-    struct dirent *de;
-    IxpMsg m;
-    char *buf = NULL;
-    uint64_t offset = r->ifcall.tread.offset;
-    uint64_t pos = 0;
-    int include_parent = 1;  // Include ".." entries but not "."
-    
-    if (!dir) {
-        ixp_respond(r, strerror(errno));
+/* Directory reading.
+ *
+ * Entries come off the descriptor in bulk with getdents64 rather than
+ * one readdir at a time, and are handled in batches. The size of an
+ * entry on the wire depends on its name, its owner's and group's names
+ * and, under 9P2000.u, a symlink's target, so each batch is statted
+ * together before anything is sized, on the io_uring when there is one,
+ * so the lookups for a cold directory go to the disk in parallel. A
+ * symlink's target is only read when 9P2000.u wants it.
+ *
+ * A client that seeks back into a huge directory would otherwise have
+ * it read again from the start. As entries go past, the stream notes the
+ * kernel's cookie for its position every DIR_MARK bytes of 9P offset, so
+ * a seek starts from the nearest mark before it instead. */
+
+enum {
+    DIRBUF = 64 * 1024,   /* Bytes of entries fetched per getdents64 */
+    DIR_BATCH = 64,       /* Entries sized and statted together */
+    DIR_MARK = 16 * 1024, /* 9P bytes between seek marks */
+};
+
+/* The kernel's record, which libc doesn't export */
+typedef struct RawDirent {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} RawDirent;
+
+/* Where a 9P offset is in the directory */
+typedef struct DirMark {
+    uint64_t pos;   /* 9P offset */
+    int64_t cookie; /* d_off of the entry before it, for lseek */
+} DirMark;
+
+struct DirStream {
+    int fd;
+    size_t len;     /* Bytes of entries in buf */
+    size_t pos;     /* Offset of the next unused entry in buf */
+    int eof;
+    DirMark *marks; /* In order of pos */
+    size_t nmarks, maxmarks;
+    char buf[DIRBUF];
+};
+
+enum { ENTRY_PACK, ENTRY_SKIP, ENTRY_DROP };
+
+typedef struct Entry {
+    const char *name;
+    size_t end;           /* Offset in the stream buffer just past it */
+    int64_t cookie;       /* Its d_off: where the next entry starts */
+    int have_stat;        /* 1 statted, -1 stat failed, 0 not yet */
+    struct stat st;
+    char *target;         /* Symlink target, for 9P2000.u */
+    int action;
+    uint16_t size;        /* Bytes on the wire */
+} Entry;
+
+DirStream *dir_open(int dirfd, const char *name) {
+    DirStream *d = malloc(sizeof(DirStream));
+    int err;
+
+    if (!d) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    d->fd = fd_keep(openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (d->fd < 0) {
+        err = errno;
+        free(d);
+        errno = err;
+        return NULL;
+    }
+    d->len = d->pos = 0;
+    d->eof = 0;
+    d->marks = NULL;
+    d->nmarks = d->maxmarks = 0;
+    return d;
+}
+
+void dir_close(DirStream *d) {
+    if (!d)
         return;
+    close(d->fd);
+    free(d->marks);
+    free(d);
+}
+
+/* Start again from the top, forgetting the marks, which may no longer
+ * hold for a directory that has changed */
+static void dir_rewind(DirStream *d) {
+    lseek(d->fd, 0, SEEK_SET);
+    d->len = d->pos = 0;
+    d->eof = 0;
+    d->nmarks = 0;
+}
+
+/* Note that the 9P offset pos starts just after the entry with cookie,
+ * if it is far enough past the last mark */
+static void dir_mark(DirStream *d, uint64_t pos, int64_t cookie) {
+    DirMark *more;
+    size_t max;
+
+    if (d->nmarks && pos < d->marks[d->nmarks - 1].pos + DIR_MARK)
+        return;
+    if (!d->nmarks && pos < DIR_MARK)
+        return;
+    if (d->nmarks == d->maxmarks) {
+        max = d->maxmarks ? d->maxmarks * 2 : 64;
+        if (!(more = realloc(d->marks, max * sizeof(DirMark))))
+            return;
+        d->marks = more;
+        d->maxmarks = max;
     }
-    
-    buf = malloc(r->ifcall.tread.count);
-    if (!buf) {
-        closedir(dir);
-        ixp_respond(r, "out of memory");
+    d->marks[d->nmarks].pos = pos;
+    d->marks[d->nmarks].cookie = cookie;
+    d->nmarks++;
+}
+
+/* Get ready to replay up to the 9P offset, which the stream, now at cur,
+ * is not at. Carries on from cur if no mark is nearer, and otherwise
+ * seeks to the last mark at or before offset. Returns the 9P offset the
+ * stream is at now. */
+static uint64_t dir_seek(DirStream *d, uint64_t offset, uint64_t cur) {
+    size_t lo = 0, hi = d->nmarks, mid;
+    DirMark *m;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (d->marks[mid].pos <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    m = lo ? &d->marks[lo - 1] : NULL;
+    if (cur < offset && (!m || cur >= m->pos))
+        return cur;
+    if (!m || lseek(d->fd, m->cookie, SEEK_SET) < 0) {
+        lseek(d->fd, 0, SEEK_SET);
+        m = NULL;
+    }
+    d->len = d->pos = 0;
+    d->eof = 0;
+    return m ? m->pos : 0;
+}
+
+/* Make sure there is an unused entry in the buffer, fetching the next
+ * lot once the current one is used up. Returns 0 at the end. */
+static int dir_fill(DirStream *d) {
+    long n;
+
+    if (d->pos < d->len)
+        return 1;
+    if (d->eof)
+        return 0;
+    n = syscall(SYS_getdents64, d->fd, d->buf, sizeof(d->buf));
+    d->pos = 0;
+    d->len = n > 0 ? n : 0;
+    if (n <= 0)
+        d->eof = 1;
+    return n > 0;
+}
+
+/* The strings of an entry, which are all that its size on the wire
+ * depends on. Owner and group need the entry statted. ubuf and gbuf
+ * hold unnamed ids as numbers, so must outlive t. */
+static void entry_text(StatText *t, Entry *e, IdMap *ids, char *ubuf, char *gbuf) {
+    stat_text(t, e->name, idmap_user(ids, e->st.st_uid, ubuf),
+              idmap_group(ids, e->st.st_gid, gbuf), e->target);
+}
+
+/* Read a symlink's target into the batch's scratch space */
+static void entry_target(int dirfd, Entry *e, Scratch *sp) {
+    char target[PATH_MAX];
+    ssize_t n;
+
+    if (e->target)
         return;
+    n = readlinkat(dirfd, e->name, target, sizeof(target) - 1);
+    e->target = scratch_strndup(sp, target, n > 0 ? n : 0);
+}
+
+static void statx_to_stat(struct statx *stx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Stat a batch of entries, all at once on the ring if we can */
+static void stat_entries(int dirfd, Entry *ents, int n) {
+    int i;
+
+    if (n == 0)
+        return;
+    if (use_uring) {
+        struct statx stx[DIR_BATCH];
+        const char *names[DIR_BATCH];
+        int res[DIR_BATCH];
+
+        for (i = 0; i < n; i++)
+            names[i] = ents[i].name;
+        if (uring_statx(dirfd, names, stx, res, n) == 0) {
+            for (i = 0; i < n; i++) {
+                ents[i].have_stat = res[i] < 0 ? -1 : 1;
+                if (res[i] >= 0)
+                    statx_to_stat(&stx[i], &ents[i].st);
+            }
+            return;
+        }
     }
+    for (i = 0; i < n; i++)
+        ents[i].have_stat = fstatat(dirfd, ents[i].name, &ents[i].st, AT_SYMLINK_NOFOLLOW) == 0 ? 1 : -1;
+}
+
+/* Seed the metadata cache with an entry; clients tend to stat what they
+ * have just listed */
+static void cache_entry(const char *dirpath, Entry *e, unsigned gen) {
+    char path[PATH_MAX];
+
+    if (strcmp(e->name, "..") == 0)
+        return;
+    if (snprintf(path, sizeof(path), "%s/%s", strcmp(dirpath, "/") == 0 ? "" : dirpath,
+                 e->name) < (int)sizeof(path))
+        md_put(path, &e->st, gen);
+}
+
+/* Pack entries from d into buf, up to room bytes, carrying on from the
+ * 9P offset *pos. Entries before offset are skipped without going into
+ * buf. Returns the number of bytes packed, 0 at the end. */
+static size_t pack_entries(DirStream *d, const char *dirpath, int version,
+                           char *buf, size_t room, uint64_t offset, uint64_t *pos) {
+    Entry ents[DIR_BATCH];
+    Scratch sp;
+    StatText t;
+    char ubuf[ID_NUMLEN], gbuf[ID_NUMLEN];
+    uint64_t plan_pos;
+    const StatFormat *fmt = stat_format(version);
+    IdMap *ids = idmap_get();
+    int full = 0;
+    int n, last, i;
+    unsigned gen;
+    size_t p, used, packed = 0, slen;
+
+    scratch_init(&sp);
     
-    m = ixp_message(buf, r->ifcall.tread.count, MsgPack);
-    m.version = ixp_req_getversion(r);
-    
-    /* Read directory entries, skipping until we reach the requested offset */
-    while ((de = readdir(dir))) {
-        IxpStat s;
-        struct stat st2;
-        char childpath[PATH_MAX];
-        uint16_t slen;
-        
-        /* Skip "." entry as it's added by the client, but include ".." */
-        if (strcmp(de->d_name, ".") == 0) {
-            continue;
+    while (!full && dir_fill(d)) {
+        /* Take the next batch from the buffer. "." is left out as the
+         * client adds it, but ".." is included. */
+        n = 0;
+        for (p = d->pos; n < DIR_BATCH && p < d->len; ) {
+            RawDirent *de = (RawDirent *)(d->buf + p);
+
+            p += de->d_reclen;
+            if (strcmp(de->d_name, ".") == 0)
+                continue;
+            memset(&ents[n], 0, sizeof(Entry));
+            ents[n].name = de->d_name;
+            ents[n].end = p;
+            ents[n].cookie = de->d_off;
+            n++;
         }
-        
-        /* Skip ".." entry only if include_parent is 0 */
-        if (!include_parent && strcmp(de->d_name, "..") == 0) {
-            continue;
+
+        gen = md_gen();
+        stat_entries(d->fd, ents, n);
+        for (i = 0; wb_pending() && i < n; i++) {
+            /* Sizes include writes another fid still has buffered */
+            if (ents[i].have_stat > 0 && S_ISREG(ents[i].st.st_mode) && wb_sync(ents[i].st.st_ino))
+                ents[i].have_stat = fstatat(d->fd, ents[i].name, &ents[i].st, AT_SYMLINK_NOFOLLOW) == 0 ? 1 : -1;
         }
-        
-        /* Safely construct the full path for the child entry */
-        int path_len = snprintf(childpath, sizeof(childpath), "%s/%s", fullpath, de->d_name);
-        if (path_len >= sizeof(childpath) || path_len < 0) {
-            /* Path would be truncated or other snprintf error, skip this entry */
-            continue;
+        /* Under 9P2000.u a symlink's size includes its target */
+        for (i = 0; fmt->dotu && i < n; i++) {
+            if (ents[i].have_stat > 0 && S_ISLNK(ents[i].st.st_mode))
+                entry_target(d->fd, &ents[i], &sp);
         }
-            
-        if (lstat(childpath, &st2) < 0) {
-            /* Failed to stat the entry, skip it */
-            continue;
+
+        /* Decide what each entry is for: skipped to reach the offset,
+         * packed into this reply, or left for the next one */
+        used = packed;
+        plan_pos = *pos;
+        last = n;
+        for (i = 0; i < n; i++) {
+            Entry *e = &ents[i];
+
+            if (e->have_stat < 0) {
+                e->action = ENTRY_DROP;
+                continue;
+            }
+            entry_text(&t, e, ids, ubuf, gbuf);
+            e->size = stat_size(fmt, &t);
+            if (plan_pos + e->size <= offset) {
+                e->action = ENTRY_SKIP;
+                plan_pos += e->size;
+                continue;
+            }
+            if (used + e->size > room) {
+                last = i;
+                break;
+            }
+            e->action = ENTRY_PACK;
+            used += e->size;
+            plan_pos += e->size;
         }
-        
-        /* Build stat structure */
-        memset(&s, 0, sizeof(IxpStat));
-        s.type = 0;
-        s.dev = 0;
-        s.qid.type = P9_QTFILE;
-        if (S_ISDIR(st2.st_mode))
-            s.qid.type = P9_QTDIR;
-        else if (S_ISLNK(st2.st_mode))
-            s.qid.type = P9_QTSYMLINK;
-            
-        s.qid.path = st2.st_ino;
-        s.qid.version = st2.st_mtime;
-        s.mode = st2.st_mode & 0777;
-        if (S_ISDIR(st2.st_mode))
-            s.mode |= P9_DMDIR;
-        else if (S_ISLNK(st2.st_mode))
-            s.mode |= P9_DMSYMLINK;
-            
-        s.atime = st2.st_atime;
-        s.mtime = st2.st_mtime;
-        s.length = st2.st_size;
-
-        /* 9P2000.u: symlink extension and numeric IDs */
-        /* extension must be non-NULL for 9P2000.u - empty string for non-symlinks */
-        if (S_ISLNK(st2.st_mode)) {
-            char target[PATH_MAX];
-            ssize_t tlen = readlink(childpath, target, sizeof(target) - 1);
-            if (tlen != -1) {
-                target[tlen] = '\0';
-                s.extension = strdup(target);
-                s.length = tlen;
-            } else {
-                s.extension = strdup("");
+
+        /* Pack them in order */
+        for (i = 0; i < last; i++) {
+            Entry *e = &ents[i];
+
+            if (e->action == ENTRY_SKIP) {
+                *pos += e->size;
+            } else if (e->action == ENTRY_PACK) {
+                entry_text(&t, e, ids, ubuf, gbuf);
+                slen = stat_pack(fmt, buf + packed, room - packed, &e->st, &t);
+                if (!slen) {
+                    full = 1;
+                    break;
+                }
+                packed += slen;
+                *pos += slen;
             }
-        } else {
-            s.extension = strdup("");
+            d->pos = e->end;
+            dir_mark(d, *pos, e->cookie);
         }
-        s.n_uid = st2.st_uid;
-        s.n_gid = st2.st_gid;
-        s.n_muid = st2.st_uid;
-
-        /* Safely handle name assignment */
-        s.name = strdup(de->d_name);
-        if (!s.name) {
-            free((char *)s.extension);
-            continue;
+        if (last < n)
+            full = 1;
+        else if (!full)
+            d->pos = p;   /* Also past any trailing "." */
+
+        for (i = 0; i < n; i++) {
+            if (ents[i].have_stat > 0 && md_active())
+                cache_entry(dirpath, &ents[i], gen);
         }
-        
-        /* Use consistent UID/GID handling */
-        const char *user = getenv("USER");
-        /* Instead of direct assignment, use string constants which libixp will handle properly */
-        s.uid = user ? (char*)user : "none";  /* Cast to remove const warning - libixp will copy this */
-        s.gid = s.uid;
-        s.muid = s.uid;
-        
-        /* Calculate size of this stat entry */
-        slen = ixp_sizeof_stat(&s, ixp_req_getversion(r));
-        
-        /* Skip entries until we reach the offset */
-        if (pos + slen <= offset) {
-            pos += slen;
-            free((char *)s.name);
-            free((char *)s.extension);
-            continue;
+        scratch_reset(&sp);   /* The batch's targets */
+    }
+    idmap_put(ids);
+    return packed;
+}
+
+/* Pack the whole directory into an image for the cache. Gives up on
+ * directories too big to be worth keeping, and notes that it did. */
+static DirImage *build_image(FidState *state, const char *path, int version, struct stat *st) {
+    DirStream *d;
+    DirImage *img, *bigger;
+    size_t max = dc_room(), size = DIRBUF, n;
+    uint64_t pos = 0;
+    unsigned gen = md_gen();
+    int big = 0;
+
+    if (size > max || !(d = dir_open(state->dirfd, leafname(path))))
+        return NULL;
+    img = malloc(sizeof(DirImage) + size);
+    if (img) {
+        img->len = 0;
+        img->big = 0;
+    }
+    while (img) {
+        /* Always leave room for the largest entry there can be */
+        if (size - img->len < DIRBUF) {
+            size *= 2;
+            big = size > max;
+            if (big || !(bigger = realloc(img, sizeof(DirImage) + size))) {
+                free(img);
+                img = NULL;
+                break;
+            }
+            img = bigger;
         }
-        
-        /* If this entry won't fit in the buffer, stop */
-        if (m.pos - buf + slen > r->ifcall.tread.count) {
-            free((char *)s.name);
-            free((char *)s.extension);
+        n = pack_entries(d, path, version, img->data + img->len,
+                         size - img->len, pos, &pos);
+        if (n == 0)
+            break;
+        img->len += n;
+    }
+    dir_close(d);
+    if (big && (img = calloc(1, sizeof(DirImage)))) {
+        img->big = 1;
+        dc_put(dc_insert(img, path, version, st, gen));
+        return NULL;
+    }
+    return img ? dc_insert(img, path, version, st, gen) : NULL;
+}
+
+/* The cached image of the fid's directory, built if need be */
+static DirImage *dir_image(FidState *state, const char *path, int version) {
+    struct stat st;
+    DirImage *img;
+
+    if (!dc_room() || md_stat(state->dirfd, path, &st) < 0)
+        return NULL;
+    if ((img = dc_lookup(path, version, &st))) {
+        if (!img->big)
+            return img;
+        dc_put(img);    /* Listed from the disk as it is read */
+        return NULL;
+    }
+    return build_image(state, path, version, &st);
+}
+
+/* Answer from an image: whole entries from the offset on, as many as
+ * fit. Each starts with its own 2-byte size. */
+static void read_image(Ixp9Req *r, DirImage *img) {
+    uint64_t offset = r->ifcall.tread.offset;
+    size_t room = read_count(r);
+    size_t start = offset < img->len ? offset : img->len;
+    size_t end, next;
+    char *buf;
+
+    for (end = start; end + 2 <= img->len; end = next) {
+        next = end + 2 + ((uint8_t)img->data[end] | (uint8_t)img->data[end + 1] << 8);
+        if (next > img->len || next - start > room)
             break;
+    }
+
+    buf = buf_alloc(end - start);
+    if (!buf) {
+        ixp_respond(r, "out of memory");
+        return;
+    }
+    memcpy(buf, img->data + start, end - start);
+    r->ofcall.rread.count = end - start;
+    r->ofcall.rread.data = buf;
+    ixp_respond(r, nil);
+}
+
+/* A listing of a read-only export, from its index. Like a listing from
+ * the disk it has ".." but not ".". The fid remembers which entry its
+ * offset has got to, so carrying on needs no scan. */
+static void read_index(Ixp9Req *r, FidState *state, const char *path) {
+    IndexNode *dir = ri_lookup(path), *e;
+    const StatFormat *fmt = stat_format(ixp_req_getversion(r));
+    uint64_t offset = r->ifcall.tread.offset;
+    size_t room = read_count(r), packed = 0, size, i;
+    char ubuf[ID_NUMLEN], gbuf[ID_NUMLEN];
+    uint64_t pos;
+    StatText t;
+    IdMap *ids;
+    char *buf;
+
+    if (!dir || !S_ISDIR(dir->st.st_mode) || dir->err) {
+        // A directory the index couldn't read fails as it did then
+        ixp_respond(r, strerror(!dir ? errno : dir->err ? dir->err : ENOTDIR));
+        return;
+    }
+    if (!(buf = buf_alloc(room))) {
+        ixp_respond(r, "out of memory");
+        return;
+    }
+
+    if (offset >= state->dir_offset && state->dir_offset > 0) {
+        pos = state->dir_offset;
+        i = state->dir_index;
+    } else {
+        pos = 0;
+        i = 0;
+    }
+    ids = idmap_get();
+    for (; i <= dir->nkids; i++) {
+        e = i == 0 ? dir->parent : dir->kids[i - 1];
+        stat_text(&t, i == 0 ? ".." : e->name, idmap_user(ids, e->st.st_uid, ubuf),
+                  idmap_group(ids, e->st.st_gid, gbuf), fmt->dotu ? e->target : NULL);
+        if (pos + stat_size(fmt, &t) <= offset) {
+            pos += stat_size(fmt, &t);
+            continue;
         }
-        
-        /* Add this entry to the result */
-        ixp_pstat(&m, &s);
+        if (!(size = stat_pack(fmt, buf + packed, room - packed, &e->st, &t)))
+            break;
+        packed += size;
+        pos += size;
+    }
+    idmap_put(ids);
 
-        /* Free our allocated strings - ixp_pstat makes its own copy */
-        free((char *)s.name);
-        free((char *)s.extension);
+    state->dir_offset = pos;
+    state->dir_index = i;
+    r->ofcall.rread.count = packed;
+    r->ofcall.rread.data = buf;
+    ixp_respond(r, nil);
+}
+
+void read_directory(Ixp9Req *r, FidState *state) {
+    DirStream *d = state->dir;
+    char path[PATH_MAX], *buf;
+    uint32_t room = read_count(r);
+    uint64_t offset = r->ifcall.tread.offset;
+    int version = ixp_req_getversion(r);
+    uint64_t pos;
 
-        pos += slen;
+    if (path_str(state->path, path, sizeof(path)) < 0) {
+        ixp_respond(r, strerror(errno));
+        return;
+    }
+    if (ri_active()) {
+        read_index(r, state, path);
+        return;
     }
     
-    closedir(dir);
-    r->ofcall.rread.count = m.pos - buf;
+    /* A listing from the start is served from the directory's cached
+     * image when there is one, and the fid keeps that image for the
+     * rest of the listing */
+    if (offset == 0) {
+        dc_put(state->image);
+        if ((state->image = dir_image(state, path, version))) {
+            dir_close(state->dir);
+            state->dir = NULL;
+        }
+    }
+    if (state->image) {
+        read_image(r, state->image);
+        return;
+    }
+
+    /* The stream stays open on the fid, so continuation reads pick up
+     * where the previous one stopped instead of rescanning */
+    if (!d) {
+        if (!(d = dir_open(state->dirfd, leafname(path)))) {
+            ixp_respond(r, strerror(errno));
+            return;
+        }
+        state->dir = d;
+        state->dir_offset = 0;
+    } else if (offset == 0) {
+        /* Rewind to pick up changes */
+        dir_rewind(d);
+        state->dir_offset = 0;
+    } else if (offset != state->dir_offset) {
+        /* Replay up to a seek from as near to it as we can */
+        state->dir_offset = dir_seek(d, offset, state->dir_offset);
+    }
+    pos = state->dir_offset;
+    
+    buf = buf_alloc(room);
+    if (!buf) {
+        ixp_respond(r, "out of memory");
+        return;
+    }
+    
+    r->ofcall.rread.count = pack_entries(d, path, version, buf, room, offset, &pos);
     r->ofcall.rread.data = buf;
+    state->dir_offset = pos;
     ixp_respond(r, nil);
     /* buf is now owned by libixp */
 }
 
-void read_symlink(Ixp9Req *r, const char *fullpath) {
+void read_symlink(Ixp9Req *r, int dirfd, const char *path) {
     /* Add extra byte for null terminator */
-    size_t buf_size = r->ifcall.tread.count + 1;
-    char *buf = malloc(buf_size);
+    size_t buf_size = read_count(r) + 1;
+    char *buf = buf_alloc(buf_size);
     int n;
     
     if (!buf) {
@@ -162,9 +574,9 @@ void read_symlink(Ixp9Req *r, const char *fullpath) {
     }
     
     /* We read one character less than the buffer size to ensure space for null terminator */
-    n = readlink(fullpath, buf, buf_size - 1);
+    n = md_readlink(dirfd, path, buf, buf_size - 1);
     if (n < 0) {
-        free(buf);
+        buf_free(buf);
         ixp_respond(r, strerror(errno));
         return;
     }
@@ -193,37 +605,35 @@ void read_symlink(Ixp9Req *r, const char *fullpath) {
     /* buf is now owned by libixp */
 }
 
-void read_file(Ixp9Req *r, const char *fullpath) {
-    int fd = open(fullpath, O_RDONLY);
-    char *buf = NULL;
-    
-    if (fd < 0) {
-        ixp_respond(r, strerror(errno));
-        return;
-    }
+/* Bytes an Rread can actually carry for this request.
+ *
+ * libixp packs every reply into its connection buffer before it writes
+ * it, and the reply to the caller's buffer is freed once sent, so there
+ * is no way to splice a file straight onto the connection from here.
+ * What we can do is never read more than the message has room for: the
+ * iounit libixp gave the fid at Ropen, which is the msize negotiated on
+ * this connection less IOHDRSZ. Only a fid libixp hasn't opened lacks
+ * one, and falls back to the most any connection can have. */
+uint32_t read_count(Ixp9Req *r) {
+    uint32_t max = r->fid->iounit ? r->fid->iounit : IXP_MAX_MSG - IOHDRSZ;
+
+    return r->ifcall.tread.count < max ? r->ifcall.tread.count : max;
+}
+
+void read_file(Ixp9Req *r, int fd) {
+    uint32_t count = read_count(r);
+    char *buf = buf_alloc(count);
     
-    buf = malloc(r->ifcall.tread.count);
     if (!buf) {
-        close(fd);
         ixp_respond(r, "out of memory");
         return;
     }
     
-    /* Position file pointer at the requested offset */
-    off_t seek_result = lseek(fd, r->ifcall.tread.offset, SEEK_SET);
-    if (seek_result == (off_t)-1) {
-        free(buf);
-        close(fd);
-        ixp_respond(r, strerror(errno));
-        return;
-    }
-    
-    /* Read the requested data */
-    ssize_t n = read(fd, buf, r->ifcall.tread.count);
-    close(fd);
+    /* Read the requested data at the requested offset */
+    ssize_t n = pread(fd, buf, count, r->ifcall.tread.offset);
     
     if (n < 0) {
-        free(buf);
+        buf_free(buf);
         ixp_respond(r, strerror(errno));
         return;
     }
@@ -232,4 +642,4 @@ void read_file(Ixp9Req *r, const char *fullpath) {
     r->ofcall.rread.data = buf;
     ixp_respond(r, nil);
     /* buf is now owned by libixp */
-}
\ No newline at end of file
+}
@@ -5,14 +5,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <libgen.h> // For dirname
 
 // fs_read handles Tread Fcall messages.
 // It determines if the path is a directory, symlink, or regular file
 // and calls the appropriate read function.
-void fs_read(Ixp9Req *r) {
-    FidState *state = r->fid->aux;
-    char fullpath[PATH_MAX];
+void fs_read(Ixp9Req *r, FidState *state) {
+    char path[PATH_MAX];
     struct stat st;
 
     if (!state || !state->path) { // Ensure FidState and path are valid
@@ -20,24 +18,45 @@ void fs_read(Ixp9Req *r) {
         return;
     }
 
-    if (!getfullpath(state->path, fullpath, sizeof(fullpath))) {
-        ixp_respond(r, ixp_errbuf()); // getfullpath sets error via ixp_werrstr
+    // Reads see the fid's own buffered writes, and other fids'
+    if (wb_flush(state) < 0) {
+        ixp_respond(r, strerror(errno));
+        return;
+    }
+    if (r->fid->qid.type == P9_QTFILE)
+        wb_sync(r->fid->qid.path);
+
+    // Small files may have been cached whole at Topen
+    if (state->content && fc_read(r, state, 1) == 0)
+        return;
+
+    // Regular files keep their descriptor from Topen/Tcreate, so go
+    // straight to it without resolving the path again
+    if (state->fd >= 0 && r->fid->qid.type == P9_QTFILE) {
+        ra_note(state, r->ifcall.tread.offset, read_count(r), 1);
+        read_file(r, state->fd);
         return;
     }
 
-    // Use lstat to get information about the file/symlink itself
-    if (lstat(fullpath, &st) < 0) {
+    // Directories being listed carry on from their cursor or image
+    if ((state->dir || state->image) && r->fid->qid.type == P9_QTDIR) {
+        read_directory(r, state);
+        return;
+    }
+
+    // Stat the file/symlink itself, relative to its directory
+    if (path_str(state->path, path, sizeof(path)) < 0 || md_stat(state->dirfd, path, &st) < 0) {
         ixp_respond(r, strerror(errno));
         return;
     }
 
     // Dispatch based on the type of file system object
     if (S_ISDIR(st.st_mode)) {
-        read_directory(r, fullpath);
+        read_directory(r, state);
     } else if (S_ISLNK(st.st_mode)) {
-        read_symlink(r, fullpath);
-    } else if (S_ISREG(st.st_mode)) {
-        read_file(r, fullpath);
+        read_symlink(r, state->dirfd, path);
+    } else if (S_ISREG(st.st_mode) && state->fd >= 0) {
+        read_file(r, state->fd);
     } else {
         // Not a directory, symlink, or regular file that we can read
         ixp_respond(r, strerror(EACCES)); // Or some other appropriate error
@@ -45,83 +64,57 @@ void fs_read(Ixp9Req *r) {
 }
 
 // fs_write handles Twrite Fcall messages.
-void fs_write(Ixp9Req *r) {
-    FidState *state = r->fid->aux;
-    char fullpath[PATH_MAX];
-    int fd;
-    int write_os_flags;
+void fs_write(Ixp9Req *r, FidState *state) {
+    ssize_t n;
 
     if (!state || !state->path) {
         ixp_respond(r, "invalid fid state for write");
         return;
     }
 
-    if (!getfullpath(state->path, fullpath, sizeof(fullpath))) {
-        ixp_respond(r, ixp_errbuf());
-        return;
-    }
-
     // Check if the FID was opened with write permissions.
-    if (!(state->open_flags & (O_WRONLY | O_RDWR))) {
+    if (!(state->open_flags & (O_WRONLY | O_RDWR)) || state->fd < 0) {
         ixp_respond(r, strerror(EBADF)); // FID not opened for writing
         return;
     }
-    
-    // Determine the flags to use for opening the file
-    // First, handle the base access mode (O_RDWR or O_WRONLY)
-    if (state->open_flags & O_RDWR) {
-        write_os_flags = O_RDWR;
-    } else {
-        write_os_flags = O_WRONLY;
-    }
-    
-    // Handle append mode specifically
+
     int is_append = (state->open_flags & O_APPEND);
-    if (is_append) {
-        write_os_flags |= O_APPEND;
-    }
-    
-    // Add O_CREAT for file creation if needed
-    write_os_flags |= O_CREAT;
-    
-    // Handle truncation - if the offset is 0 and it's not append mode, 
-    // and this is a fresh write, we might want to truncate
-    if (r->ifcall.twrite.offset == 0 && !is_append && (state->open_flags & O_TRUNC)) {
-        write_os_flags |= O_TRUNC;
+
+    // The file stays out of the caches until the fid is done with it
+    md_wrote(state);
+    dur_wrote(state);
+
+    // Small writes may be merged in the fid's write-behind buffer
+    if (state->wbuf) {
+        int ret = wb_write(state, r->ifcall.twrite.data, r->ifcall.twrite.count, r->ifcall.twrite.offset);
+        if (ret < 0) {
+            ixp_respond(r, strerror(errno));
+            return;
+        }
+        if (ret > 0) {
+            r->ofcall.rwrite.count = r->ifcall.twrite.count;
+            ixp_respond(r, nil);
+            return;
+        }
     }
 
     // Debug print 
     if (debug) {
-        fprintf(stderr, "fs_write: path=%s flags=%x append=%d offset=%lu count=%u\n", 
-                fullpath, write_os_flags, is_append, (unsigned long)r->ifcall.twrite.offset, r->ifcall.twrite.count);
-    }
-    
-    // Open the file with the determined flags - ensure it has appropriate permissions
-    fd = open(fullpath, write_os_flags, 0666);
-    if (fd < 0) {
-        ixp_respond(r, strerror(errno));
-        return;
+        char path[PATH_MAX];
+        if (path_str(state->path, path, sizeof(path)) < 0)
+            strcpy(path, "?");
+        fprintf(stderr, "fs_write: path=%s fd=%d append=%d offset=%lu count=%u\n", 
+                path, state->fd, is_append, (unsigned long)r->ifcall.twrite.offset, r->ifcall.twrite.count);
     }
-
-    ssize_t n;
     
     if (is_append) {
-        // For O_APPEND, we don't need to seek as the kernel will automatically
-        // write at the end of the file. The offset from the 9P request is ignored.
-        n = write(fd, r->ifcall.twrite.data, r->ifcall.twrite.count);
+        // The descriptor was opened with O_APPEND, so the kernel writes at
+        // the end of the file. The offset from the 9P request is ignored.
+        n = write(state->fd, r->ifcall.twrite.data, r->ifcall.twrite.count);
     } else {
-        // If not in append mode, seek to the requested offset
-        if (lseek(fd, r->ifcall.twrite.offset, SEEK_SET) < 0) {
-            close(fd);
-            ixp_respond(r, strerror(errno));
-            return;
-        }
-        
         // Write the data at the specified offset
-        n = write(fd, r->ifcall.twrite.data, r->ifcall.twrite.count);
+        n = pwrite(state->fd, r->ifcall.twrite.data, r->ifcall.twrite.count, r->ifcall.twrite.offset);
     }
-    
-    close(fd);
 
     if (n < 0) {
         ixp_respond(r, strerror(errno));
@@ -129,13 +122,16 @@ void fs_write(Ixp9Req *r) {
     }
 
     r->ofcall.rwrite.count = n;
+    // In group commit mode the reply waits until the data is on disk
+    if (dur_defer(r, state) == 0)
+        return;
     ixp_respond(r, nil);
 }
 
 // fs_open handles Topen Fcall messages.
-void fs_open(Ixp9Req *r) {
-    FidState *state = r->fid->aux;
-    char fullpath[PATH_MAX];
+void fs_open(Ixp9Req *r, FidState *state) {
+    char path[PATH_MAX];
+    const char *name;
     struct stat st;
     int flags = 0;
     
@@ -143,17 +139,24 @@ void fs_open(Ixp9Req *r) {
         ixp_respond(r, "invalid fid state");
         return;
     }
-    
-    if (!getfullpath(state->path, fullpath, sizeof(fullpath))) {
-        ixp_respond(r, "invalid path");
+
+    // A read-only export can only be opened for reading
+    if (ri_active() && ((r->ifcall.topen.mode & 3) == P9_OWRITE || (r->ifcall.topen.mode & 3) == P9_ORDWR ||
+                        (r->ifcall.topen.mode & P9_OTRUNC))) {
+        ixp_respond(r, strerror(EROFS));
         return;
     }
     
-    if (lstat(fullpath, &st) < 0) {
+    // Other fids' buffered writes land first, so the file is opened
+    // (and perhaps cached) as it really is
+    if (path_str(state->path, path, sizeof(path)) < 0 ||
+        md_stat(state->dirfd, path, &st) < 0 || wb_sync_stat(state->dirfd, path, &st) < 0) {
         ixp_respond(r, strerror(errno));
         return;
     }
     
+    name = leafname(path);
+
     /* Convert 9P open mode to Unix flags */
     switch (r->ifcall.topen.mode & 3) {
         case P9_OREAD:
@@ -176,14 +179,22 @@ void fs_open(Ixp9Req *r) {
     state->open_mode = r->ifcall.topen.mode;
     state->open_flags = flags;
     
-    /* Test if we can actually open the file with these flags */
-    if (!S_ISDIR(st.st_mode)) {
-        int fd = open(fullpath, flags);
+    /* Open the file now and keep the descriptor until the fid is freed.
+     * Symlinks are read with readlinkat, so they need no descriptor. */
+    if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        int fd = fd_keep(openat(state->dirfd, name, flags | O_NOFOLLOW | O_CLOEXEC));
         if (fd < 0) {
             ixp_respond(r, strerror(errno));
             return;
         }
-        close(fd);
+        if (state->fd >= 0)
+            close(state->fd);
+        state->fd = fd;
+        if (flags & O_TRUNC)
+            md_forget(path, 0);
+        else if (flags == O_RDONLY && !state->content)
+            state->content = fc_open(state, &st);
+        wb_open(state);
     }
     
     r->fid->qid.type = P9_QTFILE;
@@ -195,55 +206,76 @@ void fs_open(Ixp9Req *r) {
     r->fid->qid.path = st.st_ino;
     r->fid->qid.version = st.st_mtime;
     r->ofcall.ropen.qid = r->fid->qid;
+    // ixp_respond fills in iounit from the msize negotiated on this
+    // connection, and keeps it on the fid for read_count
     ixp_respond(r, nil);
 }
 
-// fs_create handles Tcreate Fcall messages.
-void fs_create(Ixp9Req *r) {
-    FidState *state = r->fid->aux; // FID for the parent directory
-    char new_relative_path[PATH_MAX];
-    char fullpath_os[PATH_MAX];    // Absolute OS path for the new file/dir
+// fs_create handles Tcreate Fcall messages. state is the fid's, which
+// names the parent directory until the create succeeds.
+void fs_create(Ixp9Req *r, FidState *state) {
+    const char *name = r->ifcall.tcreate.name;
+    char path[PATH_MAX], new_relative_path[PATH_MAX];
+    PathNode *new_path;
+    int parentfd;                  // The directory the new item goes in
     struct stat st_new;            // To stat the newly created item
     int fd_create = -1;
     mode_t mode_os;
-    FidState *new_fid_state;
 
     if (!state || !state->path) {
         ixp_respond(r, "invalid parent fid state for create");
         return;
     }
+    if (ri_active()) {
+        ixp_respond(r, strerror(EROFS));
+        return;
+    }
 
-    if (strcmp(state->path, "/") == 0) {
-        snprintf(new_relative_path, sizeof(new_relative_path), "/%s", r->ifcall.tcreate.name);
-    } else {
-        snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", state->path, r->ifcall.tcreate.name);
+    // The name is a single element within the parent directory
+    if (!name || !name[0] || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        ixp_respond(r, strerror(EINVAL));
+        return;
+    }
+
+    if (path_str(state->path, path, sizeof(path)) < 0) {
+        ixp_respond(r, strerror(errno));
+        return;
+    }
+    if (snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s",
+                 strcmp(path, "/") == 0 ? "" : path, name) >= (int)sizeof(new_relative_path)) {
+        ixp_respond(r, strerror(ENAMETOOLONG));
+        return;
     }
 
-    if (!getfullpath(new_relative_path, fullpath_os, sizeof(fullpath_os))) {
-        ixp_respond(r, ixp_errbuf());
+    parentfd = fd_keep(openat(state->dirfd, leafname(path), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (parentfd < 0) {
+        ixp_respond(r, strerror(errno));
         return;
     }
 
     mode_os = r->ifcall.tcreate.perm & 0777;
 
     if (r->ifcall.tcreate.perm & P9_DMDIR) {
-        if (mkdir(fullpath_os, mode_os) < 0) {
+        if (mkdirat(parentfd, name, mode_os) < 0) {
+            close(parentfd);
             ixp_respond(r, strerror(errno));
             return;
         }
     } else if (r->ifcall.tcreate.perm & P9_DMSYMLINK) {
         const char *target = r->ifcall.tcreate.extension;
         if (!target || !target[0]) {
+            close(parentfd);
             ixp_respond(r, "symlink target required");
             return;
         }
-        if (symlink(target, fullpath_os) < 0) {
+        if (symlinkat(target, parentfd, name) < 0) {
+            close(parentfd);
             ixp_respond(r, strerror(errno));
             return;
         }
     } else {
         // Create regular file
-        int create_os_flags = O_CREAT | O_EXCL; 
+        int create_os_flags = O_CREAT | O_EXCL | O_CLOEXEC; 
         switch (r->ifcall.tcreate.mode & 3) { 
             case P9_OREAD:  create_os_flags |= O_RDONLY; break;
             case P9_OWRITE: create_os_flags |= O_WRONLY; break;
@@ -252,50 +284,50 @@ void fs_create(Ixp9Req *r) {
         if (r->ifcall.tcreate.mode & P9_OTRUNC) create_os_flags |= O_TRUNC;
         if (r->ifcall.tcreate.mode & P9_OAPPEND) create_os_flags |= O_APPEND;
 
-        fd_create = open(fullpath_os, create_os_flags, mode_os);
+        fd_create = fd_keep(openat(parentfd, name, create_os_flags, mode_os));
         if (fd_create < 0) {
+            close(parentfd);
             ixp_respond(r, strerror(errno));
             return;
         }
-        close(fd_create); 
     }
 
-    if (lstat(fullpath_os, &st_new) < 0) {
-        ixp_respond(r, strerror(errno));
+    md_forget(new_relative_path, MD_PARENT);
+    dur_dir(parentfd);
+    if (fstatat(parentfd, name, &st_new, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !(new_path = path_child(state->path, name))) {
+        int err = errno;
+        if (fd_create >= 0) close(fd_create);
+        close(parentfd);
+        ixp_respond(r, strerror(err));
         return;
     }
 
-    if (r->fid->aux) {
-        FidState* old_state_on_fid = r->fid->aux;
-        if (old_state_on_fid->path) free(old_state_on_fid->path);
-        free(old_state_on_fid);
-        r->fid->aux = NULL;
-    }
+    // The fid now refers to the new item rather than its parent
+    path_put(state->path);
+    state->path = new_path;
+    close(state->dirfd);
+    state->dirfd = parentfd;
+    if (state->fd >= 0) close(state->fd);
+    dir_close(state->dir);
+    state->dir = NULL;
+    state->dir_offset = 0;
+    dc_put(state->image);
+    state->image = NULL;
     
-    new_fid_state = malloc(sizeof(FidState));
-    if (!new_fid_state) {
-        ixp_respond(r, "out of memory for new fid state");
-        return;
-    }
-
-    new_fid_state->path = strdup(new_relative_path);
-    if (!new_fid_state->path) {
-        free(new_fid_state);
-        ixp_respond(r, "out of memory for new fid path");
-        return;
-    }
+    // The descriptor from the create is kept for subsequent reads and writes
+    state->fd = fd_create;
     
-    new_fid_state->open_mode = r->ifcall.tcreate.mode;
-    new_fid_state->open_flags = 0; 
+    state->open_mode = r->ifcall.tcreate.mode;
+    state->open_flags = 0; 
     switch (r->ifcall.tcreate.mode & 3) {
-        case P9_OREAD:  new_fid_state->open_flags = O_RDONLY; break;
-        case P9_OWRITE: new_fid_state->open_flags = O_WRONLY; break;
-        case P9_ORDWR:  new_fid_state->open_flags = O_RDWR;   break;
+        case P9_OREAD:  state->open_flags = O_RDONLY; break;
+        case P9_OWRITE: state->open_flags = O_WRONLY; break;
+        case P9_ORDWR:  state->open_flags = O_RDWR;   break;
     }
-    if (r->ifcall.tcreate.mode & P9_OTRUNC) new_fid_state->open_flags |= O_TRUNC;
-    if (r->ifcall.tcreate.mode & P9_OAPPEND) new_fid_state->open_flags |= O_APPEND;
-
-    r->fid->aux = new_fid_state;
+    if (r->ifcall.tcreate.mode & P9_OTRUNC) state->open_flags |= O_TRUNC;
+    if (r->ifcall.tcreate.mode & P9_OAPPEND) state->open_flags |= O_APPEND;
+    wb_open(state);
 
     r->fid->qid.path = st_new.st_ino;
     r->fid->qid.version = st_new.st_mtime;
@@ -308,42 +340,47 @@ void fs_create(Ixp9Req *r) {
     }
 
     r->ofcall.rcreate.qid = r->fid->qid;
-    r->ofcall.rcreate.iounit = 0; 
-    
+    // iounit is set by ixp_respond, as for Ropen
     ixp_respond(r, nil);
 }
 
 // fs_remove handles Tremove Fcall messages.
-void fs_remove(Ixp9Req *r) {
-    FidState *state = r->fid->aux;
-    char fullpath[PATH_MAX];
+void fs_remove(Ixp9Req *r, FidState *state) {
+    char path[PATH_MAX];
+    const char *name;
     struct stat st; 
 
     if (!state || !state->path) {
         ixp_respond(r, "invalid fid state for remove");
         return;
     }
+    if (ri_active()) {
+        ixp_respond(r, strerror(EROFS));
+        return;
+    }
 
-    if (!getfullpath(state->path, fullpath, sizeof(fullpath))) {
-        ixp_respond(r, ixp_errbuf());
+    // Anything buffered is written first, as other links may see it,
+    // and a failure to is reported rather than lost with the fid
+    if (wb_flush(state) < 0) {
+        ixp_respond(r, strerror(errno));
         return;
     }
 
-    if (lstat(fullpath, &st) < 0) {
+    if (path_str(state->path, path, sizeof(path)) < 0) {
+        ixp_respond(r, strerror(errno));
+        return;
+    }
+    name = leafname(path);
+    if (fstatat(state->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
         ixp_respond(r, strerror(errno)); 
         return;
     }
 
-    if (S_ISDIR(st.st_mode)) {
-        if (rmdir(fullpath) < 0) {
-            ixp_respond(r, strerror(errno));
-            return;
-        }
-    } else { 
-        if (unlink(fullpath) < 0) {
-            ixp_respond(r, strerror(errno));
-            return;
-        }
+    if (unlinkat(state->dirfd, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0) {
+        ixp_respond(r, strerror(errno));
+        return;
     }
+    md_forget(path, MD_PARENT | MD_TREE);
+    dur_dir(state->dirfd);
     ixp_respond(r, nil);
-}
\ No newline at end of file
+}
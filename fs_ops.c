@@ -9,38 +9,27 @@
 // fs_attach handles the Tattach Fcall.
 // It initializes a new FidState for the root of the filesystem.
 void fs_attach(Ixp9Req *r) {
-    FidState *state = malloc(sizeof(FidState));
-    if (!state) {
-        ixp_respond(r, "out of memory");
+    // The root is named by its own descriptor and the leaf "."
+    int dirfd = open_parent("/");
+    if (dirfd < 0) {
+        ixp_respond(r, strerror(errno));
         return;
     }
 
-    state->path = strdup("/"); // Represents the root of the served directory
-    if (!state->path) {
-        free(state);
+    PathNode *path = path_intern("/");
+    FidState *state = path ? new_fidstate(path, dirfd) : NULL; // Represents the root of the served directory
+    if (!state) {
+        path_put(path);
+        close(dirfd);
         ixp_respond(r, "out of memory");
         return;
     }
-    state->open_mode = 0;  // Not opened in a specific mode yet
-    state->open_flags = 0; // No OS flags yet
 
-    // Set the QID for the root directory
-    // For simplicity, using inode 0 for root, but a real stat might be better
-    // if root_path itself has a stable inode.
-    // However, QID.path for attach is often special.
-    // Let's stat the actual root_path to get its properties.
-    char fullpath_root[PATH_MAX];
     struct stat st_root;
-    if (!getfullpath("/", fullpath_root, sizeof(fullpath_root))) {
-         free(state->path);
-         free(state);
-         ixp_respond(r, ixp_errbuf());
-         return;
-    }
-    if (lstat(fullpath_root, &st_root) < 0) {
-        free(state->path);
-        free(state);
-        ixp_respond(r, strerror(errno));
+    if (fstatat(state->dirfd, ".", &st_root, 0) < 0) {
+        int err = errno;
+        free_fidstate(state);
+        ixp_respond(r, strerror(err));
         return;
     }
 
@@ -52,13 +41,117 @@ void fs_attach(Ixp9Req *r) {
     ixp_respond(r, nil);
 }
 
+// walk_fail releases the descriptors and state of an unfinished walk and
+// reports how far it got.
+static void walk_fail(Ixp9Req *r, FidState *newstate, int parentfd, int objfd, int nwalked, const char *err) {
+    if (parentfd >= 0)
+        close(parentfd);
+    if (objfd >= 0)
+        close(objfd);
+    free_fidstate(newstate); // Never attached to newfid, so it's ours to free
+    r->ofcall.rwalk.nwqid = nwalked;
+    ixp_respond(r, err);
+}
+
+// walk_index walks a read-only export through its index. Only the final
+// element's directory is opened, and only when it isn't the one the fid
+// already holds.
+static void walk_index(Ixp9Req *r, FidState *newstate) {
+    char from[PATH_MAX], path[PATH_MAX];
+    size_t len;
+    IndexNode *node, *next;
+    const char *slash;
+    int i, dirfd;
+
+    if (path_str(newstate->path, from, sizeof(from)) < 0 || !(node = ri_lookup(from))) {
+        walk_fail(r, newstate, -1, -1, 0, strerror(errno));
+        return;
+    }
+    len = strlen(from);
+    memcpy(path, from, len + 1);
+    slash = strrchr(path, '/');
+    size_t dirlen = slash ? (size_t)(slash - path) : 0; // The fid's directory
+
+    for (i = 0; i < r->ifcall.twalk.nwname; i++) {
+        const char *name = r->ifcall.twalk.wname[i];
+        size_t clen = strlen(name);
+
+        if (!S_ISDIR(node->st.st_mode)) {
+            walk_fail(r, newstate, -1, -1, i, strerror(ENOTDIR));
+            return;
+        }
+        if (strcmp(name, "..") == 0) {
+            // ".." at the root stays at the root
+            if (len > 1) {
+                slash = strrchr(path, '/');
+                len = slash == path ? 1 : (size_t)(slash - path);
+                path[len] = '\0';
+                node = node->parent;
+            }
+        } else if (strcmp(name, ".") != 0 && name[0] != '\0') {
+            if (strchr(name, '/') || !(next = ri_child(node, name))) {
+                walk_fail(r, newstate, -1, -1, i, strerror(ENOENT));
+                return;
+            }
+            if (len + clen + 2 > sizeof(path)) {
+                walk_fail(r, newstate, -1, -1, i, "path too long during walk");
+                return;
+            }
+            if (len > 1)
+                path[len++] = '/';
+            memcpy(path + len, name, clen + 1);
+            len += clen;
+            node = next;
+        }
+
+        r->ofcall.rwalk.wqid[i].path = node->st.st_ino;
+        r->ofcall.rwalk.wqid[i].version = node->st.st_mtime;
+        if (S_ISDIR(node->st.st_mode)) {
+            r->ofcall.rwalk.wqid[i].type = P9_QTDIR;
+        } else if (S_ISLNK(node->st.st_mode)) {
+            r->ofcall.rwalk.wqid[i].type = P9_QTSYMLINK;
+        } else {
+            r->ofcall.rwalk.wqid[i].type = P9_QTFILE;
+        }
+    }
+    r->ofcall.rwalk.nwqid = i;
+    r->newfid->qid = r->ofcall.rwalk.wqid[i - 1];
+
+    // The clone's descriptor is for the directory of the path walked from
+    slash = strrchr(path, '/');
+    if (!slash || (size_t)(slash - path) != dirlen || strncmp(path, from, dirlen) != 0) {
+        if ((dirfd = open_parent(path)) < 0) {
+            // The last element couldn't be reached after all; the rest stand
+            walk_fail(r, newstate, -1, -1, i - 1, strerror(errno));
+            return;
+        }
+        close(newstate->dirfd);
+        newstate->dirfd = dirfd;
+    }
+    PathNode *walked = path_intern(path);
+    if (!walked) {
+        free_fidstate(newstate);
+        ixp_respond(r, "out of memory storing final path for walk");
+        return;
+    }
+    path_put(newstate->path);
+    newstate->path = walked;
+
+    set_fidstate(r->newfid, newstate);
+    ixp_respond(r, nil);
+}
+
 // fs_walk handles the Twalk Fcall.
 // It navigates the filesystem, creating a new FID (newfid) for the target path.
-void fs_walk(Ixp9Req *r) {
-    FidState *state = r->fid->aux; // Current FID's state
+// Each element is looked up relative to the previous one, so a walk costs
+// one single-name lookup per element however deep the tree is.
+void fs_walk(Ixp9Req *r, FidState *state) {
     FidState *newstate;            // State for the new FID (r->newfid)
     char current_relative_path[PATH_MAX];
-    char fullpath_os[PATH_MAX];    // For lstat
+    size_t len;                    // Length of current_relative_path
+    PathNode *path;                // The walked-to path, interned
+    int parentfd;                  // Directory holding the current element
+    int objfd;                     // The current element itself
     struct stat st;
     int i;
 
@@ -67,71 +160,129 @@ void fs_walk(Ixp9Req *r) {
         return;
     }
 
-    // Clone current fid state for the new fid
-    newstate = malloc(sizeof(FidState));
-    if (!newstate) {
-        ixp_respond(r, "out of memory");
+    // Clone current fid state for the new fid; it is not opened yet
+    int dirfd = fd_keep(fcntl(state->dirfd, F_DUPFD_CLOEXEC, 0));
+    if (dirfd < 0) {
+        ixp_respond(r, strerror(errno));
         return;
     }
-    newstate->path = strdup(state->path);
-    if (!newstate->path) {
-        free(newstate);
+    // The path is shared, not copied: a clone costs no allocation for it
+    newstate = new_fidstate(path_ref(state->path), dirfd);
+    if (!newstate) {
+        path_put(state->path);
+        close(dirfd);
         ixp_respond(r, "out of memory");
         return;
     }
-    newstate->open_mode = 0;  // New FID is not opened yet
-    newstate->open_flags = 0;
-    r->newfid->aux = newstate; // Attach new state to the new FID
 
     // If no names to walk (nwname == 0), newfid is a clone of fid
     if (r->ifcall.twalk.nwname == 0) {
         r->newfid->qid = r->fid->qid; // QID is the same
-        // newstate->path is already a copy of state->path
+        // newstate->path is already state->path
+        set_fidstate(r->newfid, newstate);
         ixp_respond(r, nil);
         return;
     }
 
-    // Make a mutable copy of the path for constructing the new path
-    strncpy(current_relative_path, newstate->path, PATH_MAX -1);
-    current_relative_path[PATH_MAX -1] = '\0';
+    if (ri_active()) {
+        walk_index(r, newstate);
+        return;
+    }
+
+    if (path_str(state->path, current_relative_path, sizeof(current_relative_path)) < 0) {
+        walk_fail(r, newstate, -1, -1, 0, "path too long during walk");
+        return;
+    }
+    len = strlen(current_relative_path);
+
+    parentfd = newstate->dirfd;
+    newstate->dirfd = -1;
+    objfd = openat(parentfd, leafname(current_relative_path), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (objfd < 0) {
+        walk_fail(r, newstate, parentfd, -1, 0, strerror(errno));
+        return;
+    }
 
     for (i = 0; i < r->ifcall.twalk.nwname; i++) {
         const char *name_component = r->ifcall.twalk.wname[i];
+        int is_root = (len == 1); // current_relative_path is "/"
+        int looked_up = 0;        // Already asked the metadata cache
+        int have_st = 0;          // st holds this element's attributes
 
-        // Append path component
-        if (strcmp(current_relative_path, "/") != 0) { // Avoid "//" for root
-            if (safe_strcat(current_relative_path, "/", PATH_MAX) < 0) {
-                ixp_respond(r, "path too long during walk");
-                // Note: newfid->aux (newstate) needs cleanup if we error out early.
-                // libixp's ixp_requtf GONE might handle freeing newfid and its aux.
-                // For now, assuming libixp handles it on error response.
-                return;
-            }
-        }
-        if (safe_strcat(current_relative_path, name_component, PATH_MAX) < 0) {
-            ixp_respond(r, "path too long during walk");
+        if (strchr(name_component, '/')) {
+            walk_fail(r, newstate, parentfd, objfd, i, strerror(ENOENT));
             return;
         }
-        
-        // Clean the path (e.g. resolve "." and "..")
-        // cleanname modifies in place.
-        // It's important that current_relative_path remains a valid 9P-style path.
-        // cleanname is more for OS paths. For 9P paths, ".." should be handled by server logic.
-        // For now, we assume wname components are valid names, not ".." or ".".
-        // If ".." is encountered, it should be resolved against current_relative_path.
-        // This simple server doesn't fully implement ".." resolution in walk beyond getfullpath.
-
-        if (!getfullpath(current_relative_path, fullpath_os, sizeof(fullpath_os))) {
-            ixp_respond(r, ixp_errbuf()); // Path became invalid
-            return;
+
+        if (strcmp(name_component, "..") == 0) {
+            // ".." at the root stays at the root
+            if (!is_root) {
+                char *slash = strrchr(current_relative_path, '/');
+
+                // The parent directory becomes the current element
+                close(objfd);
+                objfd = parentfd;
+                len = slash == current_relative_path ? 1 : (size_t)(slash - current_relative_path);
+                current_relative_path[len] = '\0';
+                if (len == 1) {
+                    // Back at the root, which is its own parent
+                    parentfd = fcntl(objfd, F_DUPFD_CLOEXEC, 0);
+                } else {
+                    // Strictly below the root, so ".." stays inside the export
+                    parentfd = openat(objfd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+                }
+                if (parentfd < 0) {
+                    walk_fail(r, newstate, -1, objfd, i, strerror(errno));
+                    return;
+                }
+            }
+        } else if (strcmp(name_component, ".") != 0 && name_component[0] != '\0') {
+            size_t clen = strlen(name_component);
+            int childfd;
+
+            if (len + clen + 2 > sizeof(current_relative_path)) {
+                walk_fail(r, newstate, parentfd, objfd, i, "path too long during walk");
+                return;
+            }
+
+            if (!is_root)
+                current_relative_path[len++] = '/';
+            memcpy(current_relative_path + len, name_component, clen + 1);
+            len += clen;
+
+            // The last element is only needed for its qid, so when the
+            // cache knows it there's nothing to open
+            childfd = -1;
+            if (i == r->ifcall.twalk.nwname - 1) {
+                looked_up = 1;
+                have_st = md_get(current_relative_path, &st) == 0;
+            }
+            if (!have_st) {
+                childfd = openat(objfd, name_component, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+                if (childfd < 0) {
+                    // If any component doesn't exist, walk fails.
+                    // Respond with error, and number of successful walks (i)
+                    walk_fail(r, newstate, parentfd, objfd, i, strerror(errno));
+                    return;
+                }
+            }
+
+            // Descend: the current element becomes the parent
+            close(parentfd);
+            parentfd = objfd;
+            objfd = childfd;
         }
 
-        if (lstat(fullpath_os, &st) < 0) {
-            // If any component doesn't exist, walk fails.
-            // Respond with error, and number of successful walks (i)
-            r->ofcall.rwalk.nwqid = i; // Report how many names were successfully walked
-            ixp_respond(r, strerror(errno));
-            return;
+        if (!looked_up)
+            have_st = md_get(current_relative_path, &st) == 0;
+        if (!have_st) {
+            unsigned gen = md_gen();
+
+            if (fstat(objfd, &st) < 0) {
+                walk_fail(r, newstate, parentfd, objfd, i, strerror(errno));
+                return;
+            }
+            md_put(current_relative_path, &st, gen);
         }
 
         // Store QID for this successfully walked component
@@ -150,25 +301,39 @@ void fs_walk(Ixp9Req *r) {
     r->ofcall.rwalk.nwqid = i;
     r->newfid->qid = r->ofcall.rwalk.wqid[i - 1]; // QID of the final target
 
-    // Update the path in newstate to the final walked path
-    free(newstate->path);
-    newstate->path = strdup(current_relative_path);
-    if (!newstate->path) {
-        // This is tricky: walk succeeded, but server ran out of memory for final path.
-        // Should ideally not happen.
+    // The new fid keeps the final element's directory; the element itself
+    // is named by the leaf of its path from here on
+    if (objfd >= 0)
+        close(objfd);
+    if ((parentfd = fd_keep(parentfd)) < 0) {
+        walk_fail(r, newstate, -1, -1, i - 1, strerror(errno));
+        return;
+    }
+    newstate->dirfd = parentfd;
+    if (!(path = path_intern(current_relative_path))) {
+        free_fidstate(newstate);
         ixp_respond(r, "out of memory storing final path for walk");
-        // The newfid is now in an inconsistent state.
         return;
     }
+    path_put(newstate->path);
+    newstate->path = path;
 
+    set_fidstate(r->newfid, newstate);
     ixp_respond(r, nil);
 }
 
 // fs_clunk handles the Tclunk Fcall.
 // It signifies that a FID is no longer needed by the client.
 // The server should release any resources associated with the FID.
-void fs_clunk(Ixp9Req *r) {
-    // FidState is freed by fs_freefid, which is called by libixp
+void fs_clunk(Ixp9Req *r, FidState *state) {
+
+    // Buffered writes go out now, and are synced if asked, so that
+    // their errors can be reported
+    if (state && (wb_flush(state) < 0 || dur_clunk(state) < 0)) {
+        ixp_respond(r, strerror(errno));
+        return;
+    }
+    // FidState is freed by pool_freefid, which is called by libixp
     // after fs_clunk responds or if the FID is implicitly clunked (e.g. Tremove).
     ixp_respond(r, nil);
 }
@@ -182,16 +347,106 @@ void fs_flush(Ixp9Req *r) {
     ixp_respond(r, nil);
 }
 
-// fs_freefid is called by libixp when a FID is destroyed.
-// It should free any auxiliary data (FidState) attached to the FID.
-void fs_freefid(IxpFid *f) {
-    if (f && f->aux) {
-        FidState *state = f->aux;
-        if (state->path) {
-            free(state->path);
-            state->path = NULL;
-        }
-        free(state);
-        f->aux = NULL;
+// new_fidstate makes an unopened FidState for path, taking ownership of
+// dirfd, the directory holding it, and of a reference to the interned
+// path. On failure neither is released.
+FidState *new_fidstate(PathNode *path, int dirfd) {
+    FidState *state = malloc(sizeof(FidState));
+    if (!state)
+        return NULL;
+    state->path = path;
+    state->dirfd = dirfd;
+    state->open_mode = 0;  // Not opened in a specific mode yet
+    state->open_flags = 0; // No OS flags yet
+    state->fd = -1;        // Not opened yet
+    state->dir = NULL;
+    state->dir_offset = 0;
+    state->dir_index = 0;
+    state->image = NULL;
+    state->content = NULL;
+    state->ra_next = state->ra_end = 0;
+    state->ra_window = 0;
+    state->wbuf = NULL;
+    state->dirty = 0;
+    state->writing = NULL;
+    state->commits = 0;
+    state->inflight = 0;
+    state->queued = 0;
+    state->closing = 0;
+    state->freed = 0;
+    pthread_rwlock_init(&state->lock, NULL);
+    return state;
+}
+
+// release_fidstate closes and frees everything a FidState holds,
+// leaving the structure itself (and its lock) in place.
+static void release_fidstate(FidState *state) {
+    if (state->path) {
+        path_put(state->path);
+        state->path = NULL;
+    }
+    if (state->fd >= 0) {
+        wb_close(state);    // Buffered writes go out before fd closes
+        uring_drain(state); // The ring may still be reading from fd
+        dur_drain(state);   // Or a group commit syncing it
+        close(state->fd);
+        state->fd = -1;
+    }
+    md_write_done(state);   // Everything written has landed
+    if (state->dirfd >= 0) {
+        close(state->dirfd);
+        state->dirfd = -1;
     }
-}
\ No newline at end of file
+    if (state->dir) {
+        dir_close(state->dir);
+        state->dir = NULL;
+    }
+    if (state->image) {
+        dc_put(state->image);
+        state->image = NULL;
+    }
+    if (state->content) {
+        fc_put(state->content);
+        state->content = NULL;
+    }
+}
+
+// free_fidstate releases a FidState and everything it holds open.
+void free_fidstate(FidState *state) {
+    release_fidstate(state);
+    pthread_rwlock_destroy(&state->lock);
+    free(state);
+}
+
+// set_fidstate attaches state to f. When f already has a state (a walk
+// with newfid == fid) the new contents move into the existing structure,
+// so a worker holding its lock never sees it freed.
+void set_fidstate(IxpFid *f, FidState *state) {
+    FidState *old = f->aux;
+
+    if (!old) {
+        f->aux = state;
+        return;
+    }
+    if (old == state)
+        return;
+    release_fidstate(old);
+    old->path = state->path;
+    old->dirfd = state->dirfd;
+    old->open_mode = state->open_mode;
+    old->open_flags = state->open_flags;
+    old->fd = state->fd;
+    old->dir = state->dir;
+    old->dir_offset = state->dir_offset;
+    old->dir_index = state->dir_index;
+    old->image = state->image;
+    old->content = state->content;
+    old->ra_next = state->ra_next;
+    old->ra_end = state->ra_end;
+    old->ra_window = state->ra_window;
+    old->wbuf = state->wbuf;
+    old->dirty = state->dirty;
+    old->writing = state->writing;
+    pthread_rwlock_destroy(&state->lock);
+    free(state);
+}
@@ -0,0 +1,261 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Owner and group names.
+ *
+ * Stats name a file's owner and group. Asking NSS for them would cost a
+ * lookup per entry listed, and the static binary can't load NSS modules
+ * anyway, so /etc/passwd and /etc/group are read straight into a pair
+ * of id tables instead. The files are looked at again at most every
+ * ID_CHECK ms, and reloaded if they have changed. Ids with no name go
+ * out as their number.
+ *
+ * A table set is never changed once built. Each reply takes a reference
+ * to the current set and looks up names in it for as long as it needs
+ * them, so a reload never pulls names out from under a reply. Cached
+ * directory images carry the old names, so a reload forgets them. */
+
+enum { ID_CHECK = 1000 };   /* ms between looks at the files */
+
+typedef struct IdEntry {
+    unsigned id;
+    const char *name;       /* nil for an empty slot */
+} IdEntry;
+
+typedef struct IdTable {
+    IdEntry *slots;
+    unsigned mask;
+    int count;
+    char *text;             /* The file, cut up; names point into it */
+} IdTable;
+
+struct IdMap {
+    int refs;
+    IdTable users, groups;
+};
+
+typedef struct IdFile {
+    const char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+} IdFile;
+
+static IdFile files[2] = { { .path = "/etc/passwd" }, { .path = "/etc/group" } };
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static IdMap *current;
+static uint64_t checked;    /* Monotonic ms of the last look, 0 for never */
+
+static unsigned long loads;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned slot(unsigned id, unsigned mask) {
+    return (id * 2654435761u) & mask;
+}
+
+/* Read a passwd or group file into t. Both have the name in the first
+ * field and the id in the third. Returns -1 if it can't be read. */
+static int load_table(IdTable *t, IdFile *f) {
+    struct stat st;
+    char *line, *next, *field[3], *end;
+    unsigned long id;
+    unsigned lines = 0, size, s;
+    ssize_t n = 0, got;
+    int fd, i;
+
+    memset(t, 0, sizeof(*t));
+    f->dev = 0;
+    f->ino = 0;
+    if((fd = open(f->path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if(fstat(fd, &st) < 0 || !(t->text = malloc(st.st_size + 1))) {
+        close(fd);
+        return -1;
+    }
+    while(n < st.st_size && (got = read(fd, t->text + n, st.st_size - n)) > 0)
+        n += got;
+    close(fd);
+    t->text[n] = '\0';
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtim;
+    f->size = st.st_size;
+
+    for(line = t->text; *line; line = next) {
+        if((next = strchr(line, '\n')))
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        lines++;
+    }
+    for(size = 16; size < lines * 2; size <<= 1)
+        ;
+    if(!(t->slots = calloc(size, sizeof(IdEntry)))) {
+        free(t->text);
+        t->text = nil;
+        return -1;
+    }
+    t->mask = size - 1;
+
+    /* The lines are NUL-separated now */
+    for(line = t->text; line < t->text + n; line = next) {
+        next = line + strlen(line) + 1;
+        field[0] = line;
+        for(i = 1; i < 3; i++) {
+            if(!(field[i] = strchr(field[i - 1], ':')))
+                break;
+            *field[i]++ = '\0';
+        }
+        if(i < 3 || !*field[0] || *field[0] == '+' || *field[0] == '-')
+            continue;
+        if((end = strchr(field[2], ':')))
+            *end = '\0';
+        id = strtoul(field[2], &end, 10);
+        if(end == field[2] || *end || id > 0xffffffffUL)
+            continue;
+        /* The first line for an id wins, as with getpwuid */
+        for(s = slot(id, t->mask); t->slots[s].name; s = (s + 1) & t->mask) {
+            if(t->slots[s].id == id)
+                break;
+        }
+        if(!t->slots[s].name) {
+            t->slots[s].id = id;
+            t->slots[s].name = field[0];
+            t->count++;
+        }
+    }
+    return 0;
+}
+
+static void free_map(IdMap *m) {
+    free(m->users.slots);
+    free(m->users.text);
+    free(m->groups.slots);
+    free(m->groups.text);
+    free(m);
+}
+
+/* Whether either file differs from when it was loaded */
+static int changed(void) {
+    struct stat st;
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        if(stat(files[i].path, &st) < 0) {
+            if(files[i].ino)
+                return 1;
+            continue;
+        }
+        if(st.st_dev != files[i].dev || st.st_ino != files[i].ino || st.st_size != files[i].size ||
+           st.st_mtim.tv_sec != files[i].mtime.tv_sec || st.st_mtim.tv_nsec != files[i].mtime.tv_nsec)
+            return 1;
+    }
+    return 0;
+}
+
+/* Called with load_lock held */
+static void reload(void) {
+    IdMap *m, *old;
+
+    if(!(m = calloc(1, sizeof(IdMap))))
+        return;
+    load_table(&m->users, &files[0]);
+    load_table(&m->groups, &files[1]);
+    m->refs = 1;    /* current's */
+
+    pthread_mutex_lock(&map_lock);
+    old = current;
+    current = m;
+    pthread_mutex_unlock(&map_lock);
+    __atomic_add_fetch(&loads, 1, __ATOMIC_RELAXED);
+    if(old) {
+        idmap_put(old);
+        /* Listings were packed with the old names */
+        md_forget("/", MD_TREE);
+    }
+}
+
+/* A reference to the current names, loading or reloading them when
+ * it's time. May be nil, which names every id by its number. */
+IdMap *idmap_get(void) {
+    uint64_t now = now_ms(), last = __atomic_load_n(&checked, __ATOMIC_RELAXED);
+    IdMap *m;
+
+    /* Only the first load is waited for; after that whoever is
+     * reloading is left to it */
+    if(!last ? pthread_mutex_lock(&load_lock) == 0 :
+       now - last >= ID_CHECK && pthread_mutex_trylock(&load_lock) == 0) {
+        if(!__atomic_load_n(&checked, __ATOMIC_RELAXED) || changed())
+            reload();
+        __atomic_store_n(&checked, now ? now : 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&load_lock);
+    }
+
+    pthread_mutex_lock(&map_lock);
+    if((m = current))
+        m->refs++;
+    pthread_mutex_unlock(&map_lock);
+    return m;
+}
+
+void idmap_put(IdMap *m) {
+    int last;
+
+    if(!m)
+        return;
+    pthread_mutex_lock(&map_lock);
+    last = --m->refs == 0;
+    pthread_mutex_unlock(&map_lock);
+    if(last)
+        free_map(m);
+}
+
+static const char *lookup(IdTable *t, unsigned id, char *buf) {
+    unsigned s;
+
+    if(t->slots) {
+        for(s = slot(id, t->mask); t->slots[s].name; s = (s + 1) & t->mask) {
+            if(t->slots[s].id == id)
+                return t->slots[s].name;
+        }
+    }
+    snprintf(buf, ID_NUMLEN, "%u", id);
+    return buf;
+}
+
+/* The name of a user or group. buf holds the number for an id with no
+ * name and must last as long as the result is used. */
+const char *idmap_user(IdMap *m, uid_t uid, char *buf) {
+    static IdTable none;
+
+    return lookup(m ? &m->users : &none, uid, buf);
+}
+
+const char *idmap_group(IdMap *m, gid_t gid, char *buf) {
+    static IdTable none;
+
+    return lookup(m ? &m->groups : &none, gid, buf);
+}
+
+void idmap_report(void) {
+    pthread_mutex_lock(&map_lock);
+    fprintf(stderr, "idmap: %d users, %d groups, %lu loads\n",
+            current ? current->users.count : 0, current ? current->groups.count : 0,
+            __atomic_load_n(&loads, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&map_lock);
+}
@@ -0,0 +1,117 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+/* Multiple event loops for the TCP listener.
+ *
+ * The main loop only accepts. Each new connection is handed round-robin
+ * to one of the serving loops over a pipe, and that loop's thread owns
+ * the connection from then on. Connections never share a loop thread
+ * with more than their share of the other clients, and nothing on the
+ * request path is shared between loops. */
+
+typedef struct Loop {
+    IxpServer srv;
+    int pipe[2];
+} Loop;
+
+static Loop *loops;
+static int nloops;
+static int next_loop;
+
+/* Runs on a serving loop: pick up a connection handed over by accept_conn */
+static void receive_conn(IxpConn *c) {
+    Loop *loop = c->aux;
+    int fd;
+
+    if(read(c->fd, &fd, sizeof(fd)) != sizeof(fd))
+        return;
+    if(debug)
+        fprintf(stderr, "loop %d: serving fd %d\n", (int)(loop - loops), fd);
+    ixp_serve9conn_fd(&loop->srv, fd, &p9srv);
+}
+
+static void *run_loop(void *arg) {
+    Loop *loop = arg;
+
+    ixp_serverloop(&loop->srv);
+    return nil;
+}
+
+/* Runs on the main loop: accept and pass the connection on */
+static void accept_conn(IxpConn *c) {
+    Loop *loop;
+    int fd;
+
+    fd = accept4(c->fd, nil, nil, SOCK_CLOEXEC);
+    if(fd < 0) {
+        if(debug)
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+        return;
+    }
+    if(fd >= FD_SETSIZE) {
+        /* The serving loop's select() couldn't wait on it */
+        if(debug)
+            fprintf(stderr, "accept: fd %d is past FD_SETSIZE\n", fd);
+        close(fd);
+        return;
+    }
+
+    loop = &loops[next_loop];
+    next_loop = (next_loop + 1) % nloops;
+    if(write(loop->pipe[1], &fd, sizeof(fd)) != sizeof(fd))
+        close(fd);
+}
+
+/* Serve connections accepted on listenfd across n event loop threads,
+ * or as many of them as can be started. Only returns if none can. */
+int serve_loops(int listenfd, int n) {
+    pthread_t tid;
+    int i;
+
+    loops = calloc(n, sizeof(Loop));
+    if(!loops)
+        return -1;
+
+    for(i = 0; i < n; i++) {
+        Loop *loop = &loops[i];
+
+        if(pipe2(loop->pipe, O_CLOEXEC) < 0)
+            break;
+        loop->srv.preselect = uring_submit;
+        ixp_listen(&loop->srv, loop->pipe[0], loop, receive_conn, nil);
+        if(pthread_create(&tid, nil, run_loop, loop) != 0) {
+            close(loop->pipe[0]);
+            close(loop->pipe[1]);
+            break;
+        }
+        pthread_detach(tid);
+    }
+
+    /* The loops already running are serving nothing yet, so carry on
+     * with them rather than leave them beside a fallback loop */
+    if(i == 0) {
+        free(loops);
+        loops = nil;
+        return -1;
+    }
+    if(i < n)
+        fprintf(stderr, "Only %d of %d event loops started\n", i, n);
+    nloops = i;
+
+    if(debug)
+        fprintf(stderr, "Serving connections on %d event loops\n", nloops);
+
+    memset(&server, 0, sizeof(server));
+    server.preselect = uring_submit;
+    ixp_listen(&server, listenfd, nil, accept_conn, nil);
+    ixp_serverloop(&server);
+    return 0;
+}
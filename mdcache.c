@@ -0,0 +1,414 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Metadata cache.
+ *
+ * Clients stat and walk the same paths over and over, so the results of
+ * lstat (and readlink, for symlinks) are kept here by path, for md_ttl
+ * milliseconds and at most md_entries of them, least recently used going
+ * first. Our own handlers forget whatever they change. Changes made
+ * behind our back show up once the entry expires.
+ *
+ * Every md_forget bumps a generation number and notes what it forgot in
+ * a ring of the last MD_RECENT. A stat that started before a forget may
+ * have seen the old file, so md_put drops a result if anything touching
+ * its path was forgotten since the stat began, or if more was forgotten
+ * than the ring remembers. Forgets elsewhere in the export leave it be.
+ *
+ * A file being written changes with every Twrite, and forgetting it each
+ * time would be a lock and a lookup per write in every cache. Instead a
+ * fid's first write marks its path (and the directory holding it) as
+ * being written, which keeps it out of the caches, and the fid forgets
+ * it once when it is done.
+ *
+ * A read-only export has all its metadata in the index instead, and the
+ * lookups here go straight to that. */
+
+typedef struct MdEntry MdEntry;
+struct MdEntry {
+    MdEntry *hnext;         /* Hash chain */
+    MdEntry *prev, *next;   /* LRU list, most recent first */
+    uint32_t hash;
+    uint64_t expires;       /* Monotonic ms */
+    struct stat st;
+    char *target;           /* Symlink target once read */
+    char path[];
+};
+
+enum {
+    MD_RECENT = 64,         /* Forgets remembered for md_fresh */
+    MD_WRITERS = 1024,      /* Slots counting fids writing */
+};
+
+/* What a forget touched, by hash */
+typedef struct MdForget {
+    uint32_t hash, parent;
+    int flags;
+} MdForget;
+
+int md_entries = 0;
+int md_ttl = 1000;
+
+static pthread_mutex_t md_lock = PTHREAD_MUTEX_INITIALIZER;
+static MdEntry **table;
+static unsigned table_mask;
+static MdEntry lru = { .prev = &lru, .next = &lru };
+static int count;
+static unsigned gen;
+static MdForget recent[MD_RECENT];      /* Forget g is at g % MD_RECENT */
+static int writing[MD_WRITERS];         /* Fids writing to a path, by hash */
+static int writing_in[MD_WRITERS];      /* The same, by their directory's */
+
+static unsigned long hits, misses, evictions;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while(*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+/* The hash of the directory holding path; the root's is its own */
+static uint32_t hash_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    uint32_t h = 2166136261u;
+
+    if(!slash || slash == path)
+        return hash_path("/");
+    while(path < slash)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+static int busy(int *slots, uint32_t hash) {
+    return __atomic_load_n(&slots[hash & (MD_WRITERS - 1)], __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Called with md_lock held. Whether nothing forgotten since generation
+ * g could touch the path with hash: the path, an entry in it, or (with
+ * MD_TREE, which is rare enough not to be worth matching) anything. */
+static int fresh(uint32_t hash, unsigned g) {
+    unsigned i;
+    MdForget *f;
+
+    if(gen - g > MD_RECENT)
+        return 0;
+    for(i = g + 1; i != gen + 1; i++) {
+        f = &recent[i % MD_RECENT];
+        if(f->hash == hash || f->parent == hash || (f->flags & MD_TREE))
+            return 0;
+    }
+    return 1;
+}
+
+/* Size the table. With no entries or no TTL the cache stays off. */
+int md_init(void) {
+    unsigned size = 1;
+
+    if(md_entries <= 0 || md_ttl <= 0)
+        return 0;
+    while(size < (unsigned)md_entries)
+        size <<= 1;
+    table = calloc(size, sizeof(MdEntry *));
+    if(!table)
+        return -1;
+    table_mask = size - 1;
+    return 0;
+}
+
+/* Called with md_lock held */
+static MdEntry *lookup(const char *path, uint32_t hash) {
+    MdEntry *e;
+
+    for(e = table[hash & table_mask]; e; e = e->hnext) {
+        if(e->hash == hash && strcmp(e->path, path) == 0)
+            return e;
+    }
+    return nil;
+}
+
+/* Called with md_lock held */
+static void drop(MdEntry *e) {
+    MdEntry **ep;
+
+    for(ep = &table[e->hash & table_mask]; *ep; ep = &(*ep)->hnext) {
+        if(*ep == e) {
+            *ep = e->hnext;
+            break;
+        }
+    }
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    count--;
+    free(e->target);
+    free(e);
+}
+
+/* Called with md_lock held */
+static void touch(MdEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+}
+
+/* Called with md_lock held. Returns the live entry for path, if any. */
+static MdEntry *get(const char *path) {
+    uint32_t hash = hash_path(path);
+    MdEntry *e;
+
+    if(busy(writing, hash))
+        return nil;
+    if((e = lookup(path, hash)) && e->expires <= now_ms()) {
+        drop(e);
+        e = nil;
+    }
+    return e;
+}
+
+/* Look path up, filling in st on a hit. Returns -1 on a miss. */
+int md_get(const char *path, struct stat *st) {
+    MdEntry *e;
+
+    if(ri_active())
+        return ri_stat(path, st);
+    if(!table)
+        return -1;
+    pthread_mutex_lock(&md_lock);
+    if((e = get(path))) {
+        *st = e->st;
+        touch(e);
+        hits++;
+    } else
+        misses++;
+    pthread_mutex_unlock(&md_lock);
+    return e ? 0 : -1;
+}
+
+/* The generation to hand to md_put for a stat that is about to start */
+unsigned md_gen(void) {
+    return __atomic_load_n(&gen, __ATOMIC_ACQUIRE);
+}
+
+void md_put(const char *path, const struct stat *st, unsigned g) {
+    uint32_t hash = hash_path(path);
+    size_t len = strlen(path);
+    MdEntry *e;
+
+    if(!table)
+        return;
+    pthread_mutex_lock(&md_lock);
+    if(!fresh(hash, g) || busy(writing, hash)) {
+        pthread_mutex_unlock(&md_lock);
+        return;
+    }
+    if((e = lookup(path, hash))) {
+        /* A new inode may be a different link */
+        if(e->st.st_ino != st->st_ino || e->st.st_ctim.tv_sec != st->st_ctim.tv_sec ||
+           e->st.st_ctim.tv_nsec != st->st_ctim.tv_nsec) {
+            free(e->target);
+            e->target = nil;
+        }
+        touch(e);
+    } else if((e = calloc(1, sizeof(MdEntry) + len + 1))) {
+        memcpy(e->path, path, len + 1);
+        e->hash = hash;
+        e->hnext = table[hash & table_mask];
+        table[hash & table_mask] = e;
+        e->prev = e->next = e;
+        touch(e);
+        if(++count > md_entries) {
+            drop(lru.prev);
+            evictions++;
+        }
+    } else {
+        pthread_mutex_unlock(&md_lock);
+        return;
+    }
+    e->st = *st;
+    e->expires = now_ms() + md_ttl;
+    pthread_mutex_unlock(&md_lock);
+}
+
+/* fstatat without following links, through the cache */
+int md_stat(int dirfd, const char *path, struct stat *st) {
+    unsigned g;
+
+    if(ri_active())
+        return ri_stat(path, st);
+    if(md_get(path, st) == 0)
+        return 0;
+    g = md_gen();
+    if(fstatat(dirfd, leafname(path), st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+    md_put(path, st, g);
+    return 0;
+}
+
+/* readlinkat through the cache. The target is only kept alongside a
+ * cached stat. */
+ssize_t md_readlink(int dirfd, const char *path, char *buf, size_t size) {
+    MdEntry *e;
+    ssize_t n;
+    unsigned g;
+
+    if(ri_active())
+        return ri_readlink(path, buf, size);
+    if(table) {
+        pthread_mutex_lock(&md_lock);
+        if((e = get(path)) && e->target && strlen(e->target) < size) {
+            n = strlen(e->target);
+            memcpy(buf, e->target, n);
+            pthread_mutex_unlock(&md_lock);
+            return n;
+        }
+        pthread_mutex_unlock(&md_lock);
+    }
+
+    g = md_gen();
+    n = readlinkat(dirfd, leafname(path), buf, size);
+    if(!table || n < 0 || (size_t)n >= size)
+        return n;
+
+    pthread_mutex_lock(&md_lock);
+    if(fresh(hash_path(path), g) && (e = get(path)) && S_ISLNK(e->st.st_mode) && !e->target)
+        e->target = strndup(buf, n);
+    pthread_mutex_unlock(&md_lock);
+    return n;
+}
+
+/* Forget what we know about path. MD_PARENT also forgets its directory,
+ * whose times and size change when entries come and go. MD_TREE also
+ * forgets everything below it. */
+void md_forget(const char *path, int flags) {
+    char parent[PATH_MAX];
+    const char *slash;
+    size_t len;
+    MdEntry *e, *next;
+    uint32_t hash = hash_path(path);
+    MdForget *f;
+
+    pthread_mutex_lock(&md_lock);
+    f = &recent[(gen + 1) % MD_RECENT];
+    f->hash = hash;
+    f->parent = hash_parent(path);
+    f->flags = flags;
+    __atomic_add_fetch(&gen, 1, __ATOMIC_RELEASE);
+    if(!table) {
+        pthread_mutex_unlock(&md_lock);
+        goto others;
+    }
+
+    if((e = lookup(path, hash)))
+        drop(e);
+
+    if((flags & MD_PARENT) && (slash = strrchr(path, '/'))) {
+        len = slash == path ? 1 : (size_t)(slash - path);
+        if(len < sizeof(parent)) {
+            memcpy(parent, path, len);
+            parent[len] = '\0';
+            if((e = lookup(parent, hash_path(parent))))
+                drop(e);
+        }
+    }
+
+    if(flags & MD_TREE) {
+        len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+        for(e = lru.next; e != &lru; e = next) {
+            next = e->next;
+            if(strncmp(e->path, path, len) == 0 && e->path[len] == '/')
+                drop(e);
+        }
+    }
+    pthread_mutex_unlock(&md_lock);
+
+others:
+    /* Directory listings hold the same metadata, and cached contents
+     * are only as good as it is. The forget is on record by now, so
+     * neither can put back what they drop here. */
+    dc_forget(path, flags);
+    fc_forget(path, flags);
+}
+
+/* Whether nothing that could touch path has been forgotten since
+ * generation g, for the caches built on this one */
+int md_fresh(const char *path, unsigned g) {
+    int ret;
+
+    pthread_mutex_lock(&md_lock);
+    ret = fresh(hash_path(path), g);
+    pthread_mutex_unlock(&md_lock);
+    return ret;
+}
+
+/* Whether a fid is writing to path, or to something in the directory
+ * path. Neither should be cached meanwhile. */
+int md_writing(const char *path) {
+    return busy(writing, hash_path(path));
+}
+
+int md_writing_in(const char *path) {
+    return busy(writing_in, hash_path(path));
+}
+
+/* The fid is writing to its path. Only its first write does anything.
+ * The counters are found again from the node in md_write_done, so the
+ * fid may be renamed meanwhile. */
+void md_wrote(FidState *state) {
+    PathNode *ref, *none = nil;
+    char path[PATH_MAX];
+
+    if(__atomic_load_n(&state->writing, __ATOMIC_ACQUIRE) ||
+       path_str(state->path, path, sizeof(path)) < 0)
+        return;
+    ref = path_ref(state->path);
+    if(!__atomic_compare_exchange_n(&state->writing, &none, ref, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        path_put(ref);
+        return;
+    }
+    __atomic_add_fetch(&writing[hash_path(path) & (MD_WRITERS - 1)], 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&writing_in[hash_parent(path) & (MD_WRITERS - 1)], 1, __ATOMIC_ACQ_REL);
+}
+
+/* The fid has finished writing, and its data is in the file: forget
+ * what was cached from before */
+void md_write_done(FidState *state) {
+    PathNode *node = state->writing;
+    char path[PATH_MAX];
+
+    if(!node)
+        return;
+    state->writing = nil;
+    path_str(node, path, sizeof(path));
+    __atomic_sub_fetch(&writing[hash_path(path) & (MD_WRITERS - 1)], 1, __ATOMIC_ACQ_REL);
+    __atomic_sub_fetch(&writing_in[hash_parent(path) & (MD_WRITERS - 1)], 1, __ATOMIC_ACQ_REL);
+    md_forget(path, 0);
+    path_put(node);
+}
+
+int md_active(void) {
+    return table != nil;
+}
+
+void md_report(void) {
+    pthread_mutex_lock(&md_lock);
+    fprintf(stderr, "mdcache: %lu hits, %lu misses, %lu evictions, %d of %d entries, ttl %d ms\n",
+            hits, misses, evictions, count, md_entries, md_ttl);
+    pthread_mutex_unlock(&md_lock);
+}
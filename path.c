@@ -1,99 +1,278 @@
 #include "server.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 
-/* Clean a path - remove . and .. components, duplicate slashes, etc. */
-void cleanname(char *name) {
-    char *p, *q, *dotdot;
-    int rooted;
+/* The final component of a 9P path; "." for the root itself so that
+ * (dirfd, leafname) always names the object */
+const char *leafname(const char *path) {
+    const char *slash = strrchr(path, '/');
 
-    if(name[0] == '\0')
+    if(!slash || slash[1] == '\0')
+        return ".";
+    return slash + 1;
+}
+
+/* Open the export-relative directory rel beneath root_fd. The kernel
+ * refuses anything that would resolve outside the export, including
+ * ".." and absolute or escaping symlinks. */
+static int open_beneath(const char *rel) {
+    int fd;
+#ifdef SYS_openat2
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    fd = syscall(SYS_openat2, root_fd, rel, &how, sizeof(how));
+    if(fd >= 0 || errno != ENOSYS)
+        return fd;
+#endif
+    /* Older kernels: fid paths never contain ".." so plain openat will do */
+    fd = openat(root_fd, rel, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return fd;
+}
+
+/* Move a descriptor that a fid keeps above FD_SETSIZE. libixp waits on
+ * its sockets and pipes with select(), which can't take a descriptor
+ * from there, and every fid holds at least one, so a client with many
+ * fids would otherwise push new connections out of its reach. When the
+ * limit doesn't go that high, no descriptor can, and fd stays put.
+ * Returns the new descriptor, or -1 having closed fd. */
+int fd_keep(int fd) {
+    int high, err;
+
+    if(fd < 0 || fd >= FD_SETSIZE)
+        return fd;
+    if((high = fcntl(fd, F_DUPFD_CLOEXEC, FD_SETSIZE)) < 0 && errno == EINVAL)
+        return fd;
+    err = errno;
+    close(fd);
+    errno = err;
+    return high;
+}
+
+/* Get an O_PATH descriptor for the directory containing a fid path.
+ * The root is its own parent, paired with the leaf name ".". It is one
+ * a fid keeps, so see fd_keep. */
+int open_parent(const char *path) {
+    char rel[PATH_MAX];
+    const char *slash;
+    size_t len;
+
+    while(*path == '/')
+        path++;
+    slash = strrchr(path, '/');
+    if(!slash)
+        return fd_keep(fcntl(root_fd, F_DUPFD_CLOEXEC, 0));
+
+    len = slash - path;
+    if(len >= sizeof(rel)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(rel, path, len);
+    rel[len] = '\0';
+    return fd_keep(open_beneath(rel));
+}
+
+/* Interned fid paths.
+ *
+ * Clients hold many fids on deep trees, and every clone walk used to
+ * copy its fid's whole path. Paths are now nodes in a shared tree of
+ * names. A node holds one name and a reference to the directory above
+ * it, so a path costs its last name on top of what its directory
+ * already costs, and memory goes with the number of distinct names
+ * rather than the length of the paths. Nodes are found by hashing the
+ * parent's address with the name, and counted by the fids, caches and
+ * children holding them. A clone takes another reference instead of a
+ * copy.
+ *
+ * Handlers work with the path as a string, which path_str builds into
+ * their buffer from the names on the way up. */
+
+struct PathNode {
+    PathNode *hnext;        /* Hash chain, by parent and name */
+    PathNode *parent;       /* nil for the root */
+    uint32_t hash;
+    int refs;               /* Holders, children included */
+    size_t len;             /* Of the whole path as a string */
+    size_t namelen;
+    char name[];
+};
+
+/* The root is never freed, and is not in the table: nothing is its child */
+static PathNode root = { .len = 1 };
+
+static pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;
+static PathNode **table;
+static unsigned table_size;
+static unsigned count;
+
+static uint32_t hash_name(PathNode *parent, const char *name, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+
+    while(len--)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+/* Called with path_lock held. Keeps chains short as paths pile up. */
+static void grow(void) {
+    unsigned size = table_size ? table_size * 2 : 1024;
+    PathNode **t, *n, *next;
+    unsigned i;
+
+    if(!(t = calloc(size, sizeof(PathNode *))))
         return;
+    for(i = 0; i < table_size; i++) {
+        for(n = table[i]; n; n = next) {
+            next = n->hnext;
+            n->hnext = t[n->hash & (size - 1)];
+            t[n->hash & (size - 1)] = n;
+        }
+    }
+    free(table);
+    table = t;
+    table_size = size;
+}
+
+/* Called with path_lock held. Drops a reference, and with the last one
+ * the node, and so on up. Dropping to zero only happens under the lock,
+ * so child never hands out a node on its way to being freed. */
+static void put_locked(PathNode *n) {
+    PathNode *parent, **np;
 
-    rooted = (name[0] == '/');
-    
-    /* invariants:
-     *  p points at beginning of path element we're considering.
-     *  q points just past the last path element we wrote (no slash).
-     *  dotdot points just past the point where .. cannot backtrack
-     *    any further (no slash).
-     */
-    p = q = dotdot = name + rooted;
-    while(*p) {
-        if(p[0] == '/') {
-            p++;
-        } else if(p[0] == '.' && (p[1] == '\0' || p[1] == '/')) {
-            p++;
-        } else if(p[0] == '.' && p[1] == '.' && (p[2] == '\0' || p[2] == '/')) {
-            p += 2;
-            if(q > dotdot) {
-                /* can backtrack */
-                while(--q > dotdot && q[-1] != '/')
-                    ;
-            } else if(!rooted) {
-                /* /.. is / but ./../ is .. */
-                if(q != name)
-                    *q++ = '/';
-                *q++ = '.';
-                *q++ = '.';
-                dotdot = q;
+    for(; n && n != &root && __atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0; n = parent) {
+        for(np = &table[n->hash & (table_size - 1)]; *np; np = &(*np)->hnext) {
+            if(*np == n) {
+                *np = n->hnext;
+                break;
             }
-        } else {
-            /* real path element */
-            if(q != name + rooted)
-                *q++ = '/';
-            while((*q = *p) != '\0' && *q != '/')
-                p++, q++;
         }
+        parent = n->parent;
+        count--;
+        free(n);
     }
-    
-    if(q == name) {
-        if(rooted) {
-            *q++ = '/';
-        } else {
-            *q++ = '.';
+}
+
+/* Called with path_lock held. The node for name in dir, with a
+ * reference for the caller, or nil if there is no memory. */
+static PathNode *child(PathNode *dir, const char *name, size_t len) {
+    uint32_t hash = hash_name(dir, name, len);
+    PathNode *n;
+
+    if(count >= table_size)
+        grow();
+    if(!table)
+        return nil;
+    for(n = table[hash & (table_size - 1)]; n; n = n->hnext) {
+        if(n->hash == hash && n->parent == dir && n->namelen == len && memcmp(n->name, name, len) == 0) {
+            __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+            return n;
         }
     }
-    *q = '\0';
+    if(!(n = malloc(sizeof(PathNode) + len + 1)))
+        return nil;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->namelen = len;
+    n->len = (dir == &root ? 0 : dir->len) + 1 + len;
+    n->parent = path_ref(dir);
+    n->hash = hash;
+    n->refs = 1;
+    n->hnext = table[hash & (table_size - 1)];
+    table[hash & (table_size - 1)] = n;
+    count++;
+    return n;
 }
 
-/* Helper to build full path - now thread-safe and secure */
-char *getfullpath(const char *path, char *buffer, size_t bufsize) {
-    char cleaned[PATH_MAX];
-    
-    if(!path || !buffer || bufsize < PATH_MAX) {
-        return NULL;
-    }
-    
-    /* Copy and clean the path */
-    strncpy(cleaned, path, PATH_MAX-1);
-    cleaned[PATH_MAX-1] = '\0';
-    cleanname(cleaned);
-    
-    /* Check for directory traversal attempts */
-    if(strstr(cleaned, "../") != NULL) {
-        ixp_werrstr("Invalid path: directory traversal attempt");
-        return NULL;
-    }
-    
-    /* Build the full path */
-    if(snprintf(buffer, bufsize, "%s%s", root_path, cleaned) >= bufsize) {
-        ixp_werrstr("Path too long");
-        return NULL;
+/* The node for a fid path, with a reference for the caller. Returns nil
+ * if there is no memory. */
+PathNode *path_intern(const char *path) {
+    PathNode *n = &root, *next;
+    const char *end;
+
+    pthread_mutex_lock(&path_lock);
+    for(;;) {
+        while(*path == '/')
+            path++;
+        if(!*path)
+            break;
+        end = strchrnul(path, '/');
+        next = child(n, path, end - path);
+        put_locked(n);
+        if(!(n = next))
+            break;
+        path = end;
     }
-    
-    return buffer;
+    pthread_mutex_unlock(&path_lock);
+    return n;
+}
+
+/* The node for name in the directory dir, with a reference for the
+ * caller, or nil if there is no memory */
+PathNode *path_child(PathNode *dir, const char *name) {
+    PathNode *n;
+
+    pthread_mutex_lock(&path_lock);
+    n = child(dir, name, strlen(name));
+    pthread_mutex_unlock(&path_lock);
+    return n;
 }
 
-/* Safe string operations */
-int safe_strcat(char *dst, const char *src, size_t dstsize) {
-    size_t dstlen = strlen(dst);
-    size_t srclen = strlen(src);
-    
-    if(dstlen + srclen >= dstsize) {
+/* Another reference to an interned path */
+PathNode *path_ref(PathNode *p) {
+    if(p != &root)
+        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+void path_put(PathNode *p) {
+    if(!p || p == &root)
+        return;
+    pthread_mutex_lock(&path_lock);
+    put_locked(p);
+    pthread_mutex_unlock(&path_lock);
+}
+
+/* Write p's path into buf, "/" for the root. Returns -1 with errno set
+ * if it doesn't fit in size bytes. */
+int path_str(PathNode *p, char *buf, size_t size) {
+    size_t end = p->len;
+
+    if(end >= size) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    
-    strcat(dst, src);
+    buf[end] = '\0';
+    for(; p != &root; p = p->parent) {
+        end -= p->namelen;
+        memcpy(buf + end, p->name, p->namelen);
+        buf[--end] = '/';
+    }
+    if(end)
+        buf[0] = '/';
     return 0;
-}
\ No newline at end of file
+}
+
+/* Whether p is the export's root */
+int path_is_root(PathNode *p) {
+    return p == &root;
+}
+
+void path_report(void) {
+    pthread_mutex_lock(&path_lock);
+    fprintf(stderr, "paths: %u names held\n", count);
+    pthread_mutex_unlock(&path_lock);
+}
@@ -0,0 +1,62 @@
+#include "server.h"
+#include <fcntl.h>
+
+/* Readahead for fids read front to back.
+ *
+ * Each fid remembers where its last read ended. A read that starts
+ * there is part of a stream, and the file ahead of it is handed to the
+ * kernel with POSIX_FADV_WILLNEED so it is on its way into the page
+ * cache before the client asks. As in the kernel's own readahead, the
+ * next window goes out once the reader is halfway into the last one,
+ * and each window is twice the one before, up to ra_max. A read
+ * anywhere else ends the stream.
+ *
+ * Reads run concurrently on a fid, so the fields are only ever loaded
+ * and stored whole; a lost update just costs a window. */
+
+enum { RA_MIN = 128 << 10 };
+
+size_t ra_max = 2 << 20;
+
+/* Start reading len bytes at offset into the page cache. On the ring
+ * this costs the caller nothing; otherwise only a worker may wait. */
+static void issue(int fd, uint64_t offset, uint32_t len, int block) {
+    if(use_uring && uring_fadvise(fd, offset, len) == 0)
+        return;
+    if(block)
+        posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+}
+
+/* A read of count bytes at offset is about to be made on the fid */
+void ra_note(FidState *state, uint64_t offset, uint32_t count, int block) {
+    uint64_t next = __atomic_load_n(&state->ra_next, __ATOMIC_RELAXED);
+    uint64_t end = __atomic_load_n(&state->ra_end, __ATOMIC_RELAXED);
+    uint32_t window = __atomic_load_n(&state->ra_window, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&state->ra_next, offset + count, __ATOMIC_RELAXED);
+    if(!ra_max || !count || state->fd < 0)
+        return;
+    if(offset != next) {
+        if(window) {
+            __atomic_store_n(&state->ra_window, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&state->ra_end, 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    if(!window) {
+        window = (size_t)count * 4 > RA_MIN ? count * 4 : RA_MIN;
+    } else if(offset + count + window / 2 < end) {
+        return;     /* Still well inside the last window */
+    } else {
+        window *= 2;
+    }
+    if(window > ra_max)
+        window = ra_max;
+    if(end < offset + count)
+        end = offset + count;
+
+    issue(state->fd, end, window, block);
+    __atomic_store_n(&state->ra_end, end + window, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->ra_window, window, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,333 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+/* Index of a read-only export.
+ *
+ * With -r the export is taken to be an image that nothing changes, so
+ * its whole tree is scanned once at startup, by several threads, into
+ * memory: every name with its stat and, for a symlink, its target. Walks,
+ * stats, symlink reads and directory listings are then answered from
+ * here without a system call, and anything that would change the tree
+ * fails with EROFS. Only opening a file for its contents goes to the
+ * kernel.
+ *
+ * A node holds its own name rather than its path, and is found by
+ * hashing its parent's address with the name, so a lookup costs one
+ * probe per path element and the index takes about as much memory as
+ * the names do plus a struct stat each. Nothing changes once the scan
+ * is over, so lookups take no locks. */
+
+static IndexNode *root;
+static int built;
+static IndexNode **table;
+static size_t table_size;           /* Power of two */
+static size_t count;
+static size_t bytes;                /* Memory the nodes take */
+static unsigned long failed;        /* Directories that couldn't be read */
+static int nomem;                   /* Something was left out for want of memory */
+
+static pthread_mutex_t ri_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ri_cond = PTHREAD_COND_INITIALIZER;
+
+/* Directories waiting to be scanned, through their hnext until they
+ * are put in the table */
+static IndexNode *todo;
+static int busy;                    /* Threads scanning a directory */
+
+static size_t hash(IndexNode *parent, const char *name) {
+    uint64_t h = 14695981039346656037ull ^ (uintptr_t)parent;
+
+    while(*name)
+        h = (h ^ (unsigned char)*name++) * 1099511628211ull;
+    return h;
+}
+
+int ri_active(void) {
+    return built;
+}
+
+/* Called with ri_lock held */
+static int grow(void) {
+    size_t size = table_size ? table_size * 2 : 1 << 16;
+    IndexNode **t, *n, *next;
+    size_t i, h;
+
+    if(!(t = calloc(size, sizeof(IndexNode *))))
+        return -1;
+    for(i = 0; i < table_size; i++) {
+        for(n = table[i]; n; n = next) {
+            next = n->hnext;
+            h = hash(n->parent, n->name) & (size - 1);
+            n->hnext = t[h];
+            t[h] = n;
+        }
+    }
+    free(table);
+    table = t;
+    table_size = size;
+    return 0;
+}
+
+/* Called with ri_lock held. A table that can't grow just gets longer
+ * chains, but there has to be one. */
+static void insert(IndexNode *n) {
+    size_t h;
+
+    if(count >= table_size && grow() < 0 && !table) {
+        nomem = 1;
+        return;
+    }
+    h = hash(n->parent, n->name) & (table_size - 1);
+    n->hnext = table[h];
+    table[h] = n;
+    count++;
+}
+
+static IndexNode *new_node(IndexNode *parent, const char *name, struct stat *st) {
+    size_t len = strlen(name);
+    IndexNode *n;
+
+    if(!(n = calloc(1, sizeof(IndexNode) + len + 1)))
+        return nil;
+    memcpy(n->name, name, len + 1);
+    n->parent = parent ? parent : n;
+    n->st = *st;
+    __atomic_add_fetch(&bytes, sizeof(IndexNode) + len + 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+/* The export-relative path of a directory being scanned, for openat */
+static int node_path(IndexNode *n, char *buf, size_t size) {
+    size_t len, end = size - 1;
+
+    buf[end] = '\0';
+    if(n == root) {
+        strcpy(buf, ".");
+        return 0;
+    }
+    for(; n != root; n = n->parent) {
+        len = strlen(n->name);
+        if(len + 1 > end)
+            return -1;
+        end -= len;
+        memcpy(buf + end, n->name, len);
+        buf[--end] = '/';
+    }
+    memmove(buf, buf + end + 1, size - end - 1);
+    return 0;
+}
+
+/* Read one directory into its node, queueing the directories in it. If
+ * it can't be read the node says why, so a listing fails rather than
+ * coming back empty. */
+static void scan(IndexNode *dir) {
+    char path[PATH_MAX], target[PATH_MAX];
+    IndexNode **kids = nil, **more, *n, *subdirs = nil;
+    size_t nkids = 0, max = 0, i;
+    struct dirent *de;
+    struct stat st;
+    ssize_t len;
+    DIR *d = nil;
+    int fd;
+
+    if(node_path(dir, path, sizeof(path)) < 0)
+        errno = ENAMETOOLONG;
+    else if((fd = openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0 &&
+            !(d = fdopendir(fd)))
+        close(fd);
+    if(!d) {
+        dir->err = errno;
+        __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    while((de = readdir(d))) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if(!(n = new_node(dir, de->d_name, &st))) {
+            __atomic_store_n(&nomem, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if(S_ISLNK(st.st_mode) && (len = readlinkat(fd, de->d_name, target, sizeof(target) - 1)) >= 0 &&
+           (n->target = strndup(target, len)))
+            __atomic_add_fetch(&bytes, len + 1, __ATOMIC_RELAXED);
+        if(nkids == max) {
+            max = max ? max * 2 : 16;
+            if(!(more = realloc(kids, max * sizeof(IndexNode *)))) {
+                free(n->target);
+                free(n);
+                __atomic_store_n(&nomem, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            kids = more;
+        }
+        kids[nkids++] = n;
+        if(S_ISDIR(st.st_mode)) {
+            n->hnext = subdirs;
+            subdirs = n;
+        }
+    }
+    closedir(d);
+    dir->kids = kids;
+    dir->nkids = nkids;
+    __atomic_add_fetch(&bytes, max * sizeof(IndexNode *), __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&ri_lock);
+    /* The subdirectories go on the queue; the rest straight in */
+    for(i = 0; i < nkids; i++) {
+        if(!S_ISDIR(kids[i]->st.st_mode))
+            insert(kids[i]);
+    }
+    while((n = subdirs)) {
+        subdirs = n->hnext;
+        n->hnext = todo;
+        todo = n;
+    }
+    pthread_cond_broadcast(&ri_cond);
+    pthread_mutex_unlock(&ri_lock);
+}
+
+static void *scanner(void *arg) {
+    IndexNode *dir;
+
+    (void)arg;
+    pthread_mutex_lock(&ri_lock);
+    for(;;) {
+        while(!todo && busy)
+            pthread_cond_wait(&ri_cond, &ri_lock);
+        if(!(dir = todo))
+            break;      /* Nothing queued and nobody left to queue more */
+        todo = dir->hnext;
+        insert(dir);
+        busy++;
+        pthread_mutex_unlock(&ri_lock);
+        scan(dir);
+        pthread_mutex_lock(&ri_lock);
+        busy--;
+        if(!busy && !todo)
+            pthread_cond_broadcast(&ri_cond);
+    }
+    pthread_mutex_unlock(&ri_lock);
+    return nil;
+}
+
+/* Scan the export with up to threads threads. Returns -1 if it couldn't
+ * be indexed, or only in part for want of memory. */
+int ri_build(int threads) {
+    pthread_t *tids;
+    struct stat st;
+    IndexNode *top;
+    int i, started = 0;
+
+    if(fstat(root_fd, &st) < 0 || !(top = new_node(nil, "", &st)))
+        return -1;
+    root = top;
+    todo = top;
+    if(threads < 1)
+        threads = 1;
+    if((tids = calloc(threads, sizeof(pthread_t)))) {
+        for(i = 0; i < threads; i++) {
+            if(pthread_create(&tids[i], nil, scanner, nil) == 0)
+                started++;
+            else
+                break;
+        }
+    }
+    if(!started)
+        scanner(nil);
+    for(i = 0; i < started; i++)
+        pthread_join(tids[i], nil);
+    free(tids);
+    if(nomem) {
+        errno = ENOMEM;
+        return -1;
+    }
+    built = 1;
+    if(debug)
+        ri_report();
+    return 0;
+}
+
+/* The entry called name in the directory dir */
+IndexNode *ri_child(IndexNode *dir, const char *name) {
+    IndexNode *n;
+
+    for(n = table[hash(dir, name) & (table_size - 1)]; n; n = n->hnext) {
+        if(n->parent == dir && n != dir && strcmp(n->name, name) == 0)
+            return n;
+    }
+    return nil;
+}
+
+/* The node for a fid path, or nil with errno set */
+IndexNode *ri_lookup(const char *path) {
+    char name[NAME_MAX + 1];
+    IndexNode *n = root;
+    const char *end;
+    size_t len;
+
+    for(;;) {
+        while(*path == '/')
+            path++;
+        if(!*path)
+            return n;
+        if(!S_ISDIR(n->st.st_mode)) {
+            errno = ENOTDIR;
+            return nil;
+        }
+        end = strchrnul(path, '/');
+        len = end - path;
+        if(len >= sizeof(name)) {
+            errno = ENAMETOOLONG;
+            return nil;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        if(!(n = ri_child(n, name))) {
+            errno = ENOENT;
+            return nil;
+        }
+        path = end;
+    }
+}
+
+int ri_stat(const char *path, struct stat *st) {
+    IndexNode *n = ri_lookup(path);
+
+    if(!n)
+        return -1;
+    *st = n->st;
+    return 0;
+}
+
+ssize_t ri_readlink(const char *path, char *buf, size_t size) {
+    IndexNode *n = ri_lookup(path);
+    size_t len;
+
+    if(!n)
+        return -1;
+    if(!S_ISLNK(n->st.st_mode) || !n->target) {
+        errno = EINVAL;
+        return -1;
+    }
+    len = strlen(n->target);
+    if(len > size)
+        len = size;
+    memcpy(buf, n->target, len);
+    return len;
+}
+
+void ri_report(void) {
+    if(!built)
+        return;
+    fprintf(stderr, "roindex: %zu entries, %zu bytes, %lu directories unreadable\n",
+            count, bytes + table_size * sizeof(IndexNode *), failed);
+}
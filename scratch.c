@@ -0,0 +1,71 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Scratch space for the strings a request needs while it builds its
+ * reply, such as the symlink targets in a directory listing. They are
+ * carved one after another out of a Scratch, which usually sits on the
+ * handler's stack, and all go at once with scratch_reset when the reply
+ * has been packed. Only when that runs out does anything come from
+ * malloc, and then in blocks of the same size. */
+
+struct ScratchBlock {
+    ScratchBlock *next;
+    size_t used, size;
+    char data[];
+};
+
+void scratch_init(Scratch *s) {
+    s->used = 0;
+    s->blocks = nil;
+}
+
+/* n bytes that last until the next scratch_reset, or nil */
+void *scratch_alloc(Scratch *s, size_t n) {
+    ScratchBlock *b;
+    size_t size;
+
+    if(n <= SCRATCH_SIZE - s->used) {
+        s->used += n;
+        return s->buf + s->used - n;
+    }
+    if((b = s->blocks) && n <= b->size - b->used) {
+        b->used += n;
+        return b->data + b->used - n;
+    }
+    size = n > SCRATCH_SIZE ? n : SCRATCH_SIZE;
+    if(!(b = malloc(sizeof(ScratchBlock) + size)))
+        return nil;
+    b->size = size;
+    b->used = n;
+    if(n > SCRATCH_SIZE && s->blocks) {
+        /* A one-off: keep carving from the block in use */
+        b->next = s->blocks->next;
+        s->blocks->next = b;
+    } else {
+        b->next = s->blocks;
+        s->blocks = b;
+    }
+    return b->data;
+}
+
+char *scratch_strndup(Scratch *s, const char *str, size_t n) {
+    char *p;
+
+    if(!(p = scratch_alloc(s, n + 1)))
+        return nil;
+    memcpy(p, str, n);
+    p[n] = '\0';
+    return p;
+}
+
+/* Release everything handed out since scratch_init */
+void scratch_reset(Scratch *s) {
+    ScratchBlock *b;
+
+    while((b = s->blocks)) {
+        s->blocks = b->next;
+        free(b);
+    }
+    s->used = 0;
+}
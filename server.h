@@ -5,47 +5,307 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #define nil NULL
 
+/* Bytes of a Tread/Twrite/Rread that aren't data. libixp advertises
+ * msize minus this as the iounit. */
+#define IOHDRSZ 24
+
 /* Global variables */
 extern IxpServer server;
 extern char *root_path;
+extern int root_fd;
 extern int debug;
 extern Ixp9Srv p9srv;
 
+/* Directory stream read in bulk (fs_dir.c) */
+typedef struct DirStream DirStream;
+
+/* Packed Rread stream of a whole directory (dircache.c) */
+typedef struct DirImage DirImage;
+struct DirImage {
+    DirImage *hnext;        /* Hash chain */
+    DirImage *prev, *next;  /* LRU list, most recent first */
+    char *path;
+    int version;            /* Stat dialect the entries are packed in */
+    dev_t dev;              /* The directory the image was built from */
+    ino_t ino;
+    struct timespec mtime, ctime;
+    uint64_t built;         /* Monotonic ms */
+    int refs;
+    int big;                /* Too big to keep: no data, just the fact */
+    size_t len;
+    char data[];
+};
+
+/* Whole contents of a small file (filecache.c) */
+typedef struct FileImage FileImage;
+struct FileImage {
+    FileImage *hnext;       /* Hash chain by inode */
+    FileImage *pnext;       /* Hash chain by path */
+    FileImage *prev, *next; /* LRU list, most recent first */
+    char *path;             /* Where it was read from, for fc_forget */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int refs;
+    int stale;              /* Changed since; reads go to the file */
+    size_t len;
+    char data[];
+};
+
+/* Write-behind buffer of a fid opened for writing (writebuf.c) */
+typedef struct WriteBuf WriteBuf;
+
+/* Strings that live as long as one reply takes to build (scratch.c) */
+enum { SCRATCH_SIZE = 2 * PATH_MAX };
+typedef struct ScratchBlock ScratchBlock;
+typedef struct Scratch {
+    size_t used;            /* Bytes of buf handed out */
+    ScratchBlock *blocks;   /* Overflow from malloc */
+    char buf[SCRATCH_SIZE];
+} Scratch;
+
+/* Layout of the stat records a connection speaks (statpack.c) */
+typedef struct StatFormat {
+    int dotu;               /* 9P2000.u fields on the end */
+    size_t fixed;           /* Bytes besides the strings themselves */
+} StatFormat;
+
+/* The strings of a stat record, measured */
+typedef struct StatText {
+    const char *name, *uid, *gid, *ext;  /* ext may be nil */
+    size_t namelen, uidlen, gidlen, extlen;
+} StatText;
+
+/* An entry in the index of a read-only export (roindex.c) */
+typedef struct IndexNode IndexNode;
+struct IndexNode {
+    IndexNode *hnext;       /* Hash chain, by parent and name */
+    IndexNode *parent;      /* The root is its own */
+    IndexNode **kids;       /* A directory's entries, in getdents order */
+    size_t nkids;
+    int err;                /* Why a directory couldn't be read, or 0 */
+    char *target;           /* A symlink's */
+    struct stat st;
+    char name[];
+};
+
+/* A fid path, interned as a tree of names (path.c) */
+typedef struct PathNode PathNode;
+
 /* Fid state structure to track open files */
 typedef struct FidState {
-    char *path;
+    PathNode *path;  /* Interned; see path_intern, and path_str for the string */
+    int dirfd;       /* O_PATH descriptor of the directory holding path */
     int open_mode;   /* 9P open mode */
     int open_flags;  /* Unix open flags */
+    int fd;          /* File descriptor from Topen/Tcreate, -1 if not open */
+    DirStream *dir;  /* Directory stream, kept open between Treads */
+    uint64_t dir_offset; /* 9P offset of the next entry in dir */
+    size_t dir_index;    /* Next entry of a listing from the index */
+    DirImage *image; /* Cached listing being read instead of dir */
+    FileImage *content; /* Cached contents being read instead of fd */
+    uint64_t ra_next;   /* Where a sequential read would start */
+    uint64_t ra_end;    /* End of the readahead asked for so far */
+    uint32_t ra_window; /* Size of the last readahead, 0 if not streaming */
+    WriteBuf *wbuf;     /* Small writes not yet passed on to fd */
+    int dirty;          /* Written since the last sync, for DUR_CLUNK */
+    PathNode *writing;  /* Path kept out of the caches; see md_wrote */
+    int commits;        /* Writes waiting on a group commit */
+    pthread_rwlock_t lock; /* Held by workers while they use the fid */
+    int inflight;    /* io_uring requests still using fd */
+    int queued;      /* Requests handed to the worker pool, not yet done */
+    int closing;     /* Clunk or remove submitted; nothing more is taken */
+    int freed;       /* libixp let go of the fid; the last request frees it */
 } FidState;
 
+/* Fid state lifetime */
+FidState *new_fidstate(PathNode *path, int dirfd);
+void free_fidstate(FidState *state);
+void set_fidstate(IxpFid *f, FidState *state);
+
 /* Path functions */
-void cleanname(char *name);
-char *getfullpath(const char *path, char *buffer, size_t bufsize);
-int safe_strcat(char *dst, const char *src, size_t dstsize);
+const char *leafname(const char *path);
+int open_parent(const char *path);
+int fd_keep(int fd);
+PathNode *path_intern(const char *path);
+PathNode *path_child(PathNode *dir, const char *name);
+PathNode *path_ref(PathNode *p);
+void path_put(PathNode *p);
+int path_str(PathNode *p, char *buf, size_t size);
+int path_is_root(PathNode *p);
+void path_report(void);
 
 /* Filesystem operations */
 void fs_attach(Ixp9Req *r);
-void fs_walk(Ixp9Req *r);
-void fs_open(Ixp9Req *r);
-void fs_read(Ixp9Req *r);
-void fs_write(Ixp9Req *r);
-void fs_create(Ixp9Req *r);
-void fs_remove(Ixp9Req *r);
-void fs_clunk(Ixp9Req *r);
-void fs_stat(Ixp9Req *r);
-void fs_wstat(Ixp9Req *r);
+/* The fid's state is the one the pool took from it at submit */
+void fs_walk(Ixp9Req *r, FidState *state);
+void fs_open(Ixp9Req *r, FidState *state);
+void fs_read(Ixp9Req *r, FidState *state);
+void fs_write(Ixp9Req *r, FidState *state);
+void fs_create(Ixp9Req *r, FidState *state);
+void fs_remove(Ixp9Req *r, FidState *state);
+void fs_clunk(Ixp9Req *r, FidState *state);
+void fs_stat(Ixp9Req *r, FidState *state);
+void fs_wstat(Ixp9Req *r, FidState *state);
 void fs_flush(Ixp9Req *r);
-void fs_freefid(IxpFid *f);
+
+/* Worker pool (workers.c) */
+extern int nworkers;
+int workers_start(int n);
+void pool_walk(Ixp9Req *r);
+void pool_open(Ixp9Req *r);
+void pool_read(Ixp9Req *r);
+void pool_write(Ixp9Req *r);
+void pool_create(Ixp9Req *r);
+void pool_remove(Ixp9Req *r);
+void pool_clunk(Ixp9Req *r);
+void pool_stat(Ixp9Req *r);
+void pool_wstat(Ixp9Req *r);
+void pool_flush(Ixp9Req *r);
+void pool_freefid(IxpFid *f);
+
+/* Event loops for TCP clients (loops.c) */
+int serve_loops(int listenfd, int n);
+
+/* io_uring backend for file data (uring.c) */
+extern int use_uring;
+int uring_start(unsigned entries);
+int uring_read(Ixp9Req *r);
+int uring_write(Ixp9Req *r);
+int uring_flush(Ixp9Req *r);
+void uring_submit(IxpServer *s);
+void uring_drain(FidState *state);
+int uring_statx(int dirfd, const char **names, struct statx *stx, int *res, int n);
+int uring_fadvise(int fd, uint64_t offset, uint32_t len);
+
+/* Readahead for sequential reads (readahead.c) */
+extern size_t ra_max;
+void ra_note(FidState *state, uint64_t offset, uint32_t count, int block);
+
+/* Write-behind (writebuf.c) */
+extern size_t wb_size;
+int wb_start(void);
+void wb_open(FidState *state);
+int wb_write(FidState *state, const char *data, uint32_t count, uint64_t offset);
+int wb_flush(FidState *state);
+int wb_pending(void);
+int wb_sync(ino_t ino);
+int wb_sync_stat(int dirfd, const char *path, struct stat *st);
+void wb_close(FidState *state);
+void wb_report(void);
+
+/* Durability of written data (durable.c) */
+enum {
+    DUR_NONE,           /* Up to the kernel's writeback */
+    DUR_CLUNK,          /* Synced when the fid is clunked */
+    DUR_GROUP,          /* Synced before each Rwrite, in shared rounds */
+};
+extern int dur_mode;
+extern int dur_interval;
+int dur_start(void);
+void dur_wrote(FidState *state);
+int dur_defer(Ixp9Req *r, FidState *state);
+int dur_flush(Ixp9Req *r);
+void dur_drain(FidState *state);
+int dur_clunk(FidState *state);
+void dur_dir(int dirfd);
+void dur_report(void);
+
+/* Metadata cache (mdcache.c) */
+enum {
+    MD_PARENT = 1,   /* Also forget the directory holding the path */
+    MD_TREE = 2,     /* Also forget everything below the path */
+    MD_ENTRIES = 8192, /* Paths cached when only -t turns the cache on */
+};
+extern int md_entries;
+extern int md_ttl;
+int md_init(void);
+int md_active(void);
+int md_get(const char *path, struct stat *st);
+unsigned md_gen(void);
+void md_put(const char *path, const struct stat *st, unsigned gen);
+int md_stat(int dirfd, const char *path, struct stat *st);
+ssize_t md_readlink(int dirfd, const char *path, char *buf, size_t size);
+void md_forget(const char *path, int flags);
+int md_fresh(const char *path, unsigned gen);
+int md_writing(const char *path);
+int md_writing_in(const char *path);
+void md_wrote(FidState *state);
+void md_write_done(FidState *state);
+void md_report(void);
+
+/* Outside changes to the export (watch.c) */
+extern int use_watch;
+int watch_start(void);
+int watch_complete(void);
+void watch_report(void);
+
+/* Directory listing cache (dircache.c) */
+extern size_t dc_limit;
+size_t dc_room(void);
+DirImage *dc_lookup(const char *path, int version, struct stat *st);
+DirImage *dc_insert(DirImage *img, const char *path, int version, struct stat *st, unsigned gen);
+void dc_put(DirImage *img);
+void dc_forget(const char *path, int flags);
+void dc_report(void);
+
+/* Small file contents cache (filecache.c) */
+extern size_t fc_limit;
+extern size_t fc_max;
+FileImage *fc_open(FidState *state, struct stat *st);
+void fc_put(FileImage *img);
+int fc_read(Ixp9Req *r, FidState *state, int block);
+int fc_serve(Ixp9Req *r);
+void fc_forget(const char *path, int flags);
+void fc_report(void);
+
+/* Reply payload buffers (bufpool.c) */
+int bufpool_init(size_t size);
+void *buf_alloc(size_t n);
+void buf_free(void *p);
+void bufpool_report(void);
+
+/* Per-request scratch strings (scratch.c) */
+void scratch_init(Scratch *s);
+void *scratch_alloc(Scratch *s, size_t n);
+char *scratch_strndup(Scratch *s, const char *str, size_t n);
+void scratch_reset(Scratch *s);
 
 /* Directory operations */
-void read_directory(Ixp9Req *r, const char *fullpath);
-void read_symlink(Ixp9Req *r, const char *fullpath);
-void read_file(Ixp9Req *r, const char *fullpath);
+DirStream *dir_open(int dirfd, const char *name);
+void dir_close(DirStream *d);
+void read_directory(Ixp9Req *r, FidState *state);
+void read_symlink(Ixp9Req *r, int dirfd, const char *path);
+void read_file(Ixp9Req *r, int fd);
+uint32_t read_count(Ixp9Req *r);
+
+/* Read-only export index (roindex.c) */
+int ri_build(int threads);
+int ri_active(void);
+IndexNode *ri_lookup(const char *path);
+IndexNode *ri_child(IndexNode *dir, const char *name);
+int ri_stat(const char *path, struct stat *st);
+ssize_t ri_readlink(const char *path, char *buf, size_t size);
+void ri_report(void);
+
+/* Owner and group names (idmap.c) */
+enum { ID_NUMLEN = 12 };    /* Room for an id written as a number */
+typedef struct IdMap IdMap;
+IdMap *idmap_get(void);
+void idmap_put(IdMap *m);
+const char *idmap_user(IdMap *m, uid_t uid, char *buf);
+const char *idmap_group(IdMap *m, gid_t gid, char *buf);
+void idmap_report(void);
 
-/* Stat helpers */
-void build_stat(IxpStat *s, const char *path, const char *fullpath, struct stat *st);
+/* Stat records (statpack.c) */
+const StatFormat *stat_format(int version);
+void stat_text(StatText *t, const char *name, const char *uid, const char *gid, const char *ext);
+size_t stat_size(const StatFormat *f, const StatText *t);
+size_t stat_pack(const StatFormat *f, char *buf, size_t room, const struct stat *st, const StatText *t);
 
 #endif /* SERVER_H */
\ No newline at end of file
@@ -6,34 +6,73 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
 
 /* Global variables */
 IxpServer server;
 char *root_path = NULL;
+int root_fd = -1;
 int debug = 0;
 
-/* 9P server operations */
+/* 9P server operations. The blocking ones go through the worker pool. */
 Ixp9Srv p9srv = {
     .attach = fs_attach,
-    .walk = fs_walk,
-    .open = fs_open,
-    .read = fs_read,
-    .write = fs_write,
-    .create = fs_create,
-    .remove = fs_remove,
-    .clunk = fs_clunk,
-    .stat = fs_stat,
-    .wstat = fs_wstat,
-    .flush = fs_flush,
-    .freefid = fs_freefid,
+    .walk = pool_walk,
+    .open = pool_open,
+    .read = pool_read,
+    .write = pool_write,
+    .create = pool_create,
+    .remove = pool_remove,
+    .clunk = pool_clunk,
+    .stat = pool_stat,
+    .wstat = pool_wstat,
+    .flush = pool_flush,
+    .freefid = pool_freefid,
 };
 
+/* Report the counters on SIGUSR1. The signal is blocked in every thread
+ * and collected here, so the reports can use stdio. */
+static void *stats_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    for(;;) {
+        if(sigwait(set, &sig) == 0) {
+            bufpool_report();
+            md_report();
+            dc_report();
+            fc_report();
+            wb_report();
+            dur_report();
+            watch_report();
+            path_report();
+            idmap_report();
+            ri_report();
+        }
+    }
+    return nil;
+}
+
+static void start_stats(void) {
+    static sigset_t set;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nil);
+    if(pthread_create(&tid, nil, stats_thread, &set) == 0)
+        pthread_detach(tid);
+}
+
 /* Handle device/stdio connection directly */
 static void serve_device(int fd) {
     if(debug)
         fprintf(stderr, "serve_device: Starting with fd=%d\n", fd);
 
     /* Set up 9P service on the already-connected fd */
+    server.preselect = uring_submit;
     ixp_serve9conn_fd(&server, fd, &p9srv);
 
     if(debug)
@@ -47,35 +86,118 @@ static void serve_device(int fd) {
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-d] [-h] [-p address] <directory>\n", prog);
+    fprintf(stderr, "Usage: %s [-d] [-h] [-p address] [-n loops] [-w workers] [-u] [-c entries] [-t ms] [-L mib] [-F mib] [-s kib] [-A kib] [-B kib] [-D mode] [-G ms] [-W] [-r] <directory>\n", prog);
     fprintf(stderr, "  -d          Enable debug output\n");
     fprintf(stderr, "  -h          Show this help\n");
     fprintf(stderr, "  -p address  Listen address (default: tcp!*!564)\n");
     fprintf(stderr, "              Use '-' for stdio mode\n");
     fprintf(stderr, "              Use /dev/path for character device\n");
+    fprintf(stderr, "  -n loops    Event loops serving TCP clients (default: CPU count)\n");
+    fprintf(stderr, "  -w workers  Threads for blocking requests (default: CPU count)\n");
+    fprintf(stderr, "              Use 0 to handle everything on the event loop\n");
+    fprintf(stderr, "  -u          Use io_uring for file reads and writes\n");
+    fprintf(stderr, "  -c entries  Paths kept in the metadata cache (default: off)\n");
+    fprintf(stderr, "  -t ms       How long cached metadata is trusted (default: %d)\n", md_ttl);
+    fprintf(stderr, "              Either turns the cache on; -t alone keeps %d paths\n", MD_ENTRIES);
+    fprintf(stderr, "  -L mib      Memory for cached directory listings (default: %zu)\n", dc_limit >> 20);
+    fprintf(stderr, "              Use 0 to turn listing caching off\n");
+    fprintf(stderr, "  -F mib      Memory for cached small file contents (default: off)\n");
+    fprintf(stderr, "  -s kib      Largest file whose contents are cached (default: %zu)\n", fc_max >> 10);
+    fprintf(stderr, "  -A kib      Largest readahead for sequential reads (default: %zu)\n", ra_max >> 10);
+    fprintf(stderr, "              Use 0 to leave readahead to the kernel\n");
+    fprintf(stderr, "  -B kib      Merge small writes in a buffer this big per fid (default: off)\n");
+    fprintf(stderr, "  -D mode     When written data is synced to disk (default: none)\n");
+    fprintf(stderr, "              none: left to the kernel; clunk: when the fid is clunked;\n");
+    fprintf(stderr, "              group: before each Rwrite, one sync shared by many writes\n");
+    fprintf(stderr, "  -G ms       How long a group commit waits for more writes (default: %d)\n", dur_interval);
+    fprintf(stderr, "  -W          Don't watch the directory for outside changes\n");
+    fprintf(stderr, "              (cached metadata then lasts until its TTL)\n");
+    fprintf(stderr, "  -r          Serve the directory read-only, indexing it all at startup\n");
 }
 
 int main(int argc, char *argv[]) {
     char *addr = nil;
+    int workers = -1;
+    int loops = -1;
+    int read_only = 0;
+    int entries_set = 0;
+    int ttl_set = 0;
     int c;
 
-    while((c = getopt(argc, argv, "dhp:")) != -1) {
+    while((c = getopt(argc, argv, "A:B:c:dD:F:G:hL:n:p:rs:t:uw:W")) != -1) {
         switch(c) {
+        case 'A':
+            ra_max = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 10 : 0;
+            break;
+        case 'B':
+            wb_size = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 10 : 0;
+            break;
+        case 'c':
+            md_entries = atoi(optarg);
+            entries_set = 1;
+            break;
         case 'd':
             debug = 1;
             break;
+        case 'D':
+            if(strcmp(optarg, "none") == 0)
+                dur_mode = DUR_NONE;
+            else if(strcmp(optarg, "clunk") == 0)
+                dur_mode = DUR_CLUNK;
+            else if(strcmp(optarg, "group") == 0)
+                dur_mode = DUR_GROUP;
+            else {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'F':
+            fc_limit = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 20 : 0;
+            break;
+        case 'G':
+            dur_interval = atoi(optarg);
+            break;
         case 'h':
             usage(argv[0]);
             exit(0);
+        case 'L':
+            dc_limit = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 20 : 0;
+            break;
         case 'p':
             addr = optarg;
             break;
+        case 'r':
+            read_only = 1;
+            break;
+        case 'n':
+            loops = atoi(optarg);
+            break;
+        case 's':
+            fc_max = atoi(optarg) > 0 ? (size_t)atoi(optarg) << 10 : 0;
+            break;
+        case 't':
+            md_ttl = atoi(optarg);
+            ttl_set = 1;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'W':
+            use_watch = 0;
+            break;
         default:
             usage(argv[0]);
             exit(1);
         }
     }
 
+    /* The metadata cache is off unless asked for, like -F and -B */
+    if(ttl_set && !entries_set)
+        md_entries = MD_ENTRIES;
+
     if(optind >= argc) {
         usage(argv[0]);
         exit(1);
@@ -94,7 +216,78 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Root path %s is not a directory\n", root_path);
         exit(1);
     }
+
+    /* All lookups are made relative to this descriptor */
+    root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(root_fd < 0) {
+        fprintf(stderr, "Cannot open root directory %s: %s\n", root_path, strerror(errno));
+        exit(1);
+    }
+
+    /* Every fid holds a directory descriptor, so allow as many as we can.
+     * They are kept above FD_SETSIZE, where libixp's select() never
+     * looks (see fd_keep), and the low ones are left for connections. */
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Before any other thread starts, so they all inherit the mask */
+    start_stats();
+
+    /* A read-only export is indexed before anything is served, and
+     * nothing changes it, so there's nothing to cache or watch */
+    if(read_only) {
+        if(ri_build(workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN)) < 0) {
+            fprintf(stderr, "Cannot index %s: %s\n", root_path, strerror(errno));
+            exit(1);
+        }
+        md_entries = 0;
+        use_watch = 0;
+    }
+
+    if(bufpool_init(IXP_MAX_MSG) < 0 && debug)
+        fprintf(stderr, "Buffer pool unavailable, using malloc\n");
+    if(md_init() < 0)
+        fprintf(stderr, "Metadata cache unavailable\n");
+    if(watch_start() < 0)
+        fprintf(stderr, "Cannot watch %s for changes (%s), relying on the cache TTL\n",
+                root_path, strerror(errno));
+    /* An Rwrite in group mode promises the data is on disk, which
+     * buffered writes can't keep */
+    if(dur_mode == DUR_GROUP && wb_size) {
+        fprintf(stderr, "Write-behind is off in group commit mode\n");
+        wb_size = 0;
+    }
+    if(dur_start() < 0) {
+        fprintf(stderr, "Cannot start the group committer\n");
+        exit(1);
+    }
+    if(wb_start() < 0) {
+        fprintf(stderr, "Cannot start the write-behind flusher, writing through\n");
+        wb_size = 0;
+    }
     
+    /* Workers and loops respond from their own threads, so libixp needs
+     * real locks */
+    if(workers < 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if(loops < 1)
+        loops = sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers > 0 || loops > 1 || use_uring || dur_mode == DUR_GROUP)
+        ixp_pthread_init();
+    if(workers > 0)
+        workers_start(workers);
+    if(debug)
+        fprintf(stderr, "Using %d worker threads\n", nworkers);
+
+    /* Replies come from the ring's completion thread */
+    if(use_uring && uring_start(256) < 0) {
+        fprintf(stderr, "io_uring unavailable (%s), using worker threads\n", strerror(errno));
+        use_uring = 0;
+    }
+
     int fd;
     
     if(!addr) {
@@ -150,8 +343,13 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
         
+        /* Spread clients over several event loops */
+        if(loops > 1 && serve_loops(fd, loops) == 0)
+            return 0;
+
         /* Initialize server */
         memset(&server, 0, sizeof(server));
+        server.preselect = uring_submit;
         
         /* Start listening */
         ixp_listen(&server, fd, &p9srv, ixp_serve9conn, nil);
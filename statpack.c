@@ -0,0 +1,139 @@
+#include "server.h"
+#include <string.h>
+
+/* Stat records straight onto the wire.
+ *
+ * libixp wants an IxpStat filled in, measures it with ixp_sizeof_stat
+ * and packs it field by field with ixp_pstat, checking the dialect and
+ * the room left as it goes. Every stat we send is made from a struct
+ * stat and a few strings, so it is quicker to write the record from
+ * those directly: the fixed part is a run of little-endian stores, and
+ * each string one length and one memcpy.
+ *
+ *	size[2] type[2] dev[4] qid[13] mode[4] atime[4] mtime[4] length[8]
+ *	name[s] uid[s] gid[s] muid[s]
+ *	9P2000.u: extension[s] n_uid[4] n_gid[4] n_muid[4]
+ *
+ * Which of the two layouts a connection speaks is worked out from its
+ * libixp version number the first time it is seen and remembered, so a
+ * reply only has to look its StatFormat up once. The answer is kept per
+ * version number for the whole server, not per connection: libixp gives
+ * each dialect one number, so every connection with that number speaks
+ * the same layout. Only the last number seen for each layout is kept;
+ * any other just costs another probe. */
+
+static const StatFormat plain = { 0, 49 };
+static const StatFormat dotu = { 1, 49 + 2 + 12 };
+
+static int plain_version = -1, dotu_version = -1;
+
+/* Ask libixp whether stats in this dialect carry the extension */
+static int has_extension(int version) {
+    IxpStat s;
+    uint16_t n;
+
+    memset(&s, 0, sizeof(s));
+    s.name = s.uid = s.gid = s.muid = s.extension = "";
+    n = ixp_sizeof_stat(&s, version);
+    s.extension = "x";
+    return ixp_sizeof_stat(&s, version) != n;
+}
+
+const StatFormat *stat_format(int version) {
+    if(version == __atomic_load_n(&dotu_version, __ATOMIC_RELAXED))
+        return &dotu;
+    if(version == __atomic_load_n(&plain_version, __ATOMIC_RELAXED))
+        return &plain;
+    if(has_extension(version)) {
+        __atomic_store_n(&dotu_version, version, __ATOMIC_RELAXED);
+        return &dotu;
+    }
+    __atomic_store_n(&plain_version, version, __ATOMIC_RELAXED);
+    return &plain;
+}
+
+/* Fill in t, measuring the strings once. ext may be nil. */
+void stat_text(StatText *t, const char *name, const char *uid, const char *gid, const char *ext) {
+    t->name = name;
+    t->namelen = strlen(name);
+    t->uid = uid;
+    t->uidlen = strlen(uid);
+    t->gid = gid;
+    t->gidlen = strlen(gid);
+    t->ext = ext;
+    t->extlen = ext ? strlen(ext) : 0;
+}
+
+/* Bytes the record takes on the wire, size field included */
+size_t stat_size(const StatFormat *f, const StatText *t) {
+    return f->fixed + t->namelen + 2 * t->uidlen + t->gidlen + (f->dotu ? t->extlen : 0);
+}
+
+static char *put16(char *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static char *put32(char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static char *put64(char *p, uint64_t v) {
+    return put32(put32(p, v), v >> 32);
+}
+
+static char *putstr(char *p, const char *s, size_t len) {
+    p = put16(p, len);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* Write the record for st into buf. A symlink's length is that of its
+ * target when t has one. Returns the bytes written, or 0 if the record
+ * needs more than room. */
+size_t stat_pack(const StatFormat *f, char *buf, size_t room, const struct stat *st, const StatText *t) {
+    size_t size = stat_size(f, t);
+    uint32_t mode = st->st_mode & 0777;
+    uint8_t type = P9_QTFILE;
+    uint64_t length = st->st_size;
+    char *p = buf;
+
+    if(size > room || size - 2 > 0xffff)
+        return 0;
+    if(S_ISDIR(st->st_mode)) {
+        type = P9_QTDIR;
+        mode |= P9_DMDIR;
+    } else if(S_ISLNK(st->st_mode)) {
+        type = P9_QTSYMLINK;
+        mode |= P9_DMSYMLINK;
+        if(t->ext)
+            length = t->extlen;
+    }
+
+    p = put16(p, size - 2);
+    p = put16(p, 0);                /* type */
+    p = put32(p, 0);                /* dev */
+    *p++ = type;
+    p = put32(p, st->st_mtime);     /* qid.version */
+    p = put64(p, st->st_ino);       /* qid.path */
+    p = put32(p, mode);
+    p = put32(p, st->st_atime);
+    p = put32(p, st->st_mtime);
+    p = put64(p, length);
+    p = putstr(p, t->name, t->namelen);
+    p = putstr(p, t->uid, t->uidlen);
+    p = putstr(p, t->gid, t->gidlen);
+    p = putstr(p, t->uid, t->uidlen);   /* muid */
+    if(f->dotu) {
+        p = putstr(p, t->ext ? t->ext : "", t->extlen);
+        p = put32(p, st->st_uid);
+        p = put32(p, st->st_gid);
+        p = put32(p, st->st_uid);   /* n_muid */
+    }
+    return p - buf;
+}
@@ -12,6 +12,7 @@ _HARNESS_CURRENT_PORT=""
 _HARNESS_TCP_ADDRESS=""
 _HARNESS_FUSE_MOUNT_PATH_FULL=""
 NO_MOUNT=0
+SERVER_ARGS=""
 _CURRENT_TEST_RUN_ARCHIVE_DIR=""
 
 _harness_log() {
@@ -54,6 +55,7 @@ test_setup() {
         rm -rf "$_HARNESS_TEMP_DIR"; return 1; }
     _harness_log "Current dir: $(pwd)"
     NO_MOUNT=0
+    SERVER_ARGS="" # Extra simple9p options, set by setup.sh
     if [[ -f "./setup.sh" ]]; then
         _harness_log "Sourcing setup.sh..."
         source "./setup.sh"
@@ -108,8 +110,8 @@ test_connect() {
     _HARNESS_FUSE_MOUNT_PATH_FULL="$(pwd)/mount"
     local abs_actual_path; abs_actual_path=$(realpath "./actual") # Ensure server gets absolute path
 
-    _harness_log "Starting server: $SIMPLE9P_BINARY -p \"$_HARNESS_TCP_ADDRESS\" \"$abs_actual_path\""
-    "$SIMPLE9P_BINARY" -p "$_HARNESS_TCP_ADDRESS" "$abs_actual_path" &
+    _harness_log "Starting server: $SIMPLE9P_BINARY $SERVER_ARGS -p \"$_HARNESS_TCP_ADDRESS\" \"$abs_actual_path\""
+    "$SIMPLE9P_BINARY" $SERVER_ARGS -p "$_HARNESS_TCP_ADDRESS" "$abs_actual_path" &
     _HARNESS_SERVER_PID=$!
     _harness_log "Server PID: $_HARNESS_SERVER_PID"
     if ! _wait_for_tcp_port "localhost" "$_HARNESS_CURRENT_PORT"; then
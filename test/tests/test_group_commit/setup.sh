@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+SERVER_ARGS="-D group -G 2"
+mkdir -p data
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+set -e
+# Every Rwrite waits for a sync in group commit mode; the data must
+# come back intact whether the writes share a sync or not
+dd if=/dev/zero of=disk.img bs=4k count=256 status=none
+for i in 1 2 3 4; do
+    printf 'block %d' "$i" | dd of=disk.img bs=4k seek="$i" conv=notrunc status=none &
+done
+wait
+ls -l disk.img | awk '{print $5}'
+for i in 1 2 3 4; do
+    dd if=disk.img bs=4k skip="$i" count=1 status=none | tr -d '\0'
+    echo
+done
+echo "Group commit test complete."
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+mkdir -p data/big
+# Enough entries that a listing takes many Tread round trips
+for i in $(seq -w 1 2000); do
+    echo "$i" > "data/big/file_$i.txt"
+done
+echo "Large directory created."
@@ -0,0 +1,17 @@
+#!/usr/bin/env bash
+set -e
+echo "Counting entries..."
+ls big | wc -l
+ls big | sort | md5sum
+ls -l big | sort | head -5
+ls -l big | sort | tail -5
+
+# A second listing must rewind and see the same entries
+ls big | sort | md5sum
+
+# New entries show up on a fresh listing
+echo "late" > big/file_late.txt
+ls big | wc -l
+cat big/file_late.txt
+cat big/file_1000.txt
+echo "Large directory listing test complete."
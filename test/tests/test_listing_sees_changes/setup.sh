@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+mkdir -p data/dir
+for i in $(seq -w 1 50); do
+    echo "$i" > "data/dir/file_$i.txt"
+done
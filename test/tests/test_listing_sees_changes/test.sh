@@ -0,0 +1,20 @@
+#!/usr/bin/env bash
+set -e
+# Listings may come from the server's cache, so each change must show
+# up on the next one
+ls -l dir | sort | md5sum
+ls -l dir | sort | md5sum
+
+echo "longer contents" > dir/file_01.txt
+ls -l dir | grep file_01.txt | awk '{print $5}'
+
+touch dir/new.txt
+ls dir | wc -l
+
+mv dir/file_02.txt dir/moved.txt
+ls dir | grep -c file_02.txt || true
+ls dir | grep moved.txt
+
+rm dir/file_03.txt
+ls dir | wc -l
+echo "Listing change test complete."
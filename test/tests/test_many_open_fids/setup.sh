@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+# More files than select() can take descriptors, spread over directories
+for d in $(seq 0 49); do
+    mkdir -p "data/many/d$d"
+done
+for i in $(seq 0 1099); do
+    echo "file $i" > "data/many/d$((i % 50))/f$i"
+done
@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+set -e
+ulimit -n 4096
+# Hold every file open at once, so the server has a fid on each
+fds=()
+for i in $(seq 0 1099); do
+    exec {fd}<"many/d$((i % 50))/f$i"
+    fds+=("$fd")
+done
+echo "Holding ${#fds[@]} files open"
+
+# Each descriptor still reads its own file
+for i in 0 1 512 1023 1024 1099; do
+    read -r line <&"${fds[$i]}"
+    echo "$line"
+done
+
+# New files can still be created and listed while they are all held
+echo "late" > many/late.txt
+cat many/late.txt
+ls many | wc -l
+
+for fd in "${fds[@]}"; do
+    exec {fd}<&-
+done
+echo "Closed them all"
@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+SERVER_ARGS="-F 4"
+mkdir -p data/etc
+for i in $(seq -w 1 20); do
+    echo "setting_$i=value_$i" > "data/etc/conf_$i"
+done
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+set -e
+# Small files are served from the server's content cache; rereads must
+# see every change
+cat etc/conf_* | md5sum
+cat etc/conf_* | md5sum
+
+echo "setting_01=changed_1" > etc/conf_01
+cat etc/conf_01
+
+# Same size, so only the mtime tells the contents apart
+echo "setting_02=VALUE_02" > etc/conf_02
+cat etc/conf_02
+cat etc/conf_02
+echo "Small file cache test complete."
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+mkdir -p data/owned
+# Ids with no passwd or group entry go over the wire as numbers
+for i in 1 2 3; do
+    echo "owned $i" > "data/owned/file_$i.txt"
+done
+chown 4242:4343 data/owned/file_*.txt
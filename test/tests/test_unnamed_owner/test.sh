@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+set -e
+echo "--- Listing files owned by unnamed ids ---"
+ls -ln owned | awk 'NR > 1 { print $1, $3, $4, $5, $NF }'
+stat -c '%n %u %g %s' owned/file_2.txt
+cat owned/file_3.txt
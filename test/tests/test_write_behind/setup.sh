@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+SERVER_ARGS="-B 64"
+mkdir -p data
+printf 'header\n' > data/app.log
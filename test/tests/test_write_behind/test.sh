@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+set -e
+# Many small appends are merged by the server; all of them must land,
+# in order, and be visible to the next reader
+for i in $(seq 1 500); do
+    echo "entry $i"
+done | while read -r line; do echo "$line" >> app.log; done
+wc -l < app.log
+md5sum < app.log
+tail -3 app.log
+
+# Overwrites in the middle of buffered data
+printf 'HEADER' | dd of=app.log conv=notrunc status=none
+head -1 app.log
+
+# A reader on another fid sees each write while the writer is still open
+exec 3>> app.log
+for i in 1 2 3; do
+    echo "open entry $i" >&3
+    tail -1 app.log
+    wc -c < app.log
+done
+exec 3>&-
+echo "Write-behind test complete."
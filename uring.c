@@ -0,0 +1,452 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* io_uring backend for file data.
+ *
+ * Treads and Twrites on open regular files skip the worker pool: the
+ * event loop queues them on a shared ring and carries on, and a single
+ * completion thread sends the replies. Submissions are batched until the
+ * loop is about to select() again, so a burst of requests costs one
+ * io_uring_enter rather than one syscall each.
+ *
+ * The ring is driven with raw syscalls so the static build needs nothing
+ * beyond the kernel headers. If the kernel can't give us a ring (too
+ * old, or blocked by seccomp) everything stays on the worker pool. */
+
+typedef struct UringOp UringOp;
+struct UringOp {
+    Ixp9Req *r;
+    FidState *state;
+    char *buf;          /* Read buffer, handed to libixp with the reply */
+    int write;
+    Ixp9Req *flush;     /* Tflush waiting for this request to finish */
+    UringOp *next;
+};
+
+/* One statx of a batch. Its address goes in user_data with the low bit
+ * set, to tell it apart from a UringOp. */
+typedef struct StatxSlot {
+    int *left;          /* Slots of the batch still outstanding */
+    int *res;
+} StatxSlot;
+
+int use_uring = 0;
+
+static int ring_fd = -1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned cq_size;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static unsigned pending;    /* SQEs written but not yet submitted */
+static unsigned nops;       /* Requests submitted and not yet completed */
+static UringOp *ops;
+
+static int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nil, 0);
+}
+
+/* Called with ring_lock held */
+static void submit_pending(void) {
+    int n;
+
+    while(pending > 0) {
+        n = ring_enter(pending, 0, 0);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(debug)
+                fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+            return;
+        }
+        pending -= n;
+    }
+}
+
+/* Called with ring_lock held */
+static struct io_uring_sqe *get_sqe(void) {
+    unsigned tail = *sq_tail;
+
+    if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries) {
+        submit_pending();
+        if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries)
+            return nil;
+    }
+    return &sqes[tail & *sq_mask];
+}
+
+static void complete(UringOp *op, int res) {
+    Ixp9Req *r = op->r;
+    Ixp9Req *flush;
+
+    if(res < 0) {
+        buf_free(op->buf);
+        ixp_respond(r, strerror(-res));
+    } else if(op->write) {
+        dur_wrote(op->state);
+        r->ofcall.rwrite.count = res;
+        ixp_respond(r, nil);
+    } else {
+        r->ofcall.rread.count = res;
+        r->ofcall.rread.data = op->buf;
+        ixp_respond(r, nil);
+        /* buf is now owned by libixp */
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    for(UringOp **opp = &ops; *opp; opp = &(*opp)->next) {
+        if(*opp == op) {
+            *opp = op->next;
+            break;
+        }
+    }
+    flush = op->flush;
+    op->state->inflight--;
+    nops--;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&ring_lock);
+
+    /* The flushed request has had its reply; now the Rflush can go */
+    if(flush)
+        ixp_respond(flush, nil);
+    free(op);
+}
+
+static void complete_statx(StatxSlot *slot, int res) {
+    pthread_mutex_lock(&ring_lock);
+    *slot->res = res;
+    (*slot->left)--;
+    nops--;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/* A fire-and-forget request has finished; nobody wants the result */
+static void complete_hint(void) {
+    pthread_mutex_lock(&ring_lock);
+    nops--;
+    pthread_cond_broadcast(&drain_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void *completer(void *arg) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    uint64_t ud;
+    int res;
+
+    (void)arg;
+    for(;;) {
+        if(ring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            fprintf(stderr, "io_uring completion: %s\n", strerror(errno));
+            return nil;
+        }
+        head = *cq_head;
+        while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &cqes[head & *cq_mask];
+            ud = cqe->user_data;
+            res = cqe->res;
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if(ud == 0)
+                complete_hint();
+            else if(ud & 1)
+                complete_statx((StatxSlot *)(uintptr_t)(ud & ~(uint64_t)1), res);
+            else
+                complete((UringOp *)(uintptr_t)ud, res);
+        }
+    }
+    return nil;
+}
+
+/* Set up the ring and its completion thread. Returns -1 if io_uring
+ * isn't usable here, in which case the worker pool does the I/O. */
+int uring_start(unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq_ptr, *cq_ptr;
+    unsigned *array;
+    pthread_t tid;
+    unsigned i;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(ring_fd < 0)
+        return -1;
+
+    /* IORING_OP_READ/WRITE and offset -1 for appends arrived with this */
+    if(!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(cq_len > sq_len)
+            sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    sq_ptr = mmap(nil, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED)
+        goto fail;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else {
+        cq_ptr = mmap(nil, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    sqes = mmap(nil, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+        goto fail;
+
+    sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    sq_entries = (unsigned *)(sq_ptr + p.sq_off.ring_entries);
+    array = (unsigned *)(sq_ptr + p.sq_off.array);
+    cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    cq_size = p.cq_entries;
+
+    /* SQE slots are used in ring order, so map each index to itself once */
+    for(i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    if(pthread_create(&tid, nil, completer, nil) != 0)
+        goto fail;
+    pthread_detach(tid);
+    return 0;
+
+fail:
+    i = errno;
+    close(ring_fd);
+    ring_fd = -1;
+    errno = i;
+    return -1;
+}
+
+/* Queue the request on the ring. Returns -1 if the caller should handle
+ * it the ordinary way instead. */
+static int queue_op(Ixp9Req *r, int write) {
+    FidState *state = r->fid->aux;
+    struct io_uring_sqe *sqe;
+    UringOp *op;
+
+    if(ring_fd < 0 || !state)
+        return -1;
+    /* Don't wait on the loop thread if the fid is being changed */
+    if(pthread_rwlock_tryrdlock(&state->lock) != 0)
+        return -1;
+    if(state->fd < 0 || r->fid->qid.type != P9_QTFILE)
+        goto fallback;
+    /* Fids with a write-behind buffer keep their I/O in order on the
+     * pool, and reads that may need another fid's buffer flushed go
+     * there too */
+    if(state->wbuf || (!write && wb_pending()))
+        goto fallback;
+    /* Group commits are queued from the pool's write handler */
+    if(write && dur_mode == DUR_GROUP)
+        goto fallback;
+    if(write && !(state->open_flags & (O_WRONLY | O_RDWR)))
+        goto fallback;
+
+    if(!(op = calloc(1, sizeof(UringOp))))
+        goto fallback;
+    op->r = r;
+    op->state = state;
+    op->write = write;
+    /* The file stays out of the caches until the fid is done with it */
+    if(write)
+        md_wrote(state);
+    if(!write && !(op->buf = buf_alloc(read_count(r)))) {
+        free(op);
+        goto fallback;
+    }
+    if(!write)
+        ra_note(state, r->ifcall.tread.offset, read_count(r), 0);
+
+    pthread_mutex_lock(&ring_lock);
+    /* Keep the completion queue from overflowing */
+    if(nops >= cq_size || !(sqe = get_sqe())) {
+        pthread_mutex_unlock(&ring_lock);
+        buf_free(op->buf);
+        free(op);
+        goto fallback;
+    }
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = state->fd;
+    sqe->user_data = (uintptr_t)op;
+    if(write) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)r->ifcall.twrite.data;
+        sqe->len = r->ifcall.twrite.count;
+        /* O_APPEND descriptors write at the end; the 9P offset is ignored */
+        sqe->off = (state->open_flags & O_APPEND) ? (uint64_t)-1 : r->ifcall.twrite.offset;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t)op->buf;
+        sqe->len = read_count(r);
+        sqe->off = r->ifcall.tread.offset;
+    }
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    nops++;
+    state->inflight++;
+    op->next = ops;
+    ops = op;
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_rwlock_unlock(&state->lock);
+    return 0;
+
+fallback:
+    pthread_rwlock_unlock(&state->lock);
+    return -1;
+}
+
+int uring_read(Ixp9Req *r) {
+    return queue_op(r, 0);
+}
+
+int uring_write(Ixp9Req *r) {
+    return queue_op(r, 1);
+}
+
+/* IxpServer preselect hook: hand everything queued this round to the
+ * kernel before the loop goes back to sleep. */
+void uring_submit(IxpServer *s) {
+    (void)s;
+    if(ring_fd < 0)
+        return;
+    pthread_mutex_lock(&ring_lock);
+    submit_pending();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/* Tflush for a request on the ring. Returns 1 if it was found; the
+ * Rflush then goes out after the request's own reply. */
+int uring_flush(Ixp9Req *r) {
+    UringOp *op;
+
+    if(ring_fd < 0)
+        return 0;
+    pthread_mutex_lock(&ring_lock);
+    for(op = ops; op; op = op->next) {
+        if(op->r == r->oldreq && !op->flush) {
+            op->flush = r;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ring_lock);
+    return op != nil;
+}
+
+/* Queue POSIX_FADV_WILLNEED on fd. Nothing waits for it; user_data 0
+ * tells the completion thread to drop the result. Returns -1 if the
+ * ring is too busy to take it. */
+int uring_fadvise(int fd, uint64_t offset, uint32_t len) {
+    struct io_uring_sqe *sqe;
+
+    if(ring_fd < 0)
+        return -1;
+    pthread_mutex_lock(&ring_lock);
+    if(nops >= cq_size || !(sqe = get_sqe())) {
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = len;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    sqe->user_data = 0;
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    nops++;
+    pthread_mutex_unlock(&ring_lock);
+    return 0;
+}
+
+/* Wait for the ring to finish with the fid's descriptor */
+void uring_drain(FidState *state) {
+    if(ring_fd < 0)
+        return;
+    pthread_mutex_lock(&ring_lock);
+    if(state->inflight > 0)
+        submit_pending();
+    while(state->inflight > 0)
+        pthread_cond_wait(&drain_cond, &ring_lock);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/* Stat n names in dirfd without following symlinks, all in flight at
+ * once, and wait for them. res[i] is 0 or -errno. Returns -1 without
+ * doing anything if the ring can't take the whole batch. */
+int uring_statx(int dirfd, const char **names, struct statx *stx, int *res, int n) {
+    struct io_uring_sqe *sqe;
+    StatxSlot *slots;
+    int left = 0;
+    int i;
+
+    if(ring_fd < 0 || !(slots = calloc(n, sizeof(StatxSlot))))
+        return -1;
+
+    pthread_mutex_lock(&ring_lock);
+    if(nops + n > cq_size) {
+        pthread_mutex_unlock(&ring_lock);
+        free(slots);
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        /* A full SQ is submitted to make room, so this only fails if
+         * the kernel won't take anything */
+        if(!(sqe = get_sqe())) {
+            res[i] = -EAGAIN;
+            continue;
+        }
+        slots[i].left = &left;
+        slots[i].res = &res[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t)names[i];
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t)&stx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = (uintptr_t)&slots[i] | 1;
+        __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+        pending++;
+        nops++;
+        left++;
+    }
+    submit_pending();
+    while(left > 0)
+        pthread_cond_wait(&drain_cond, &ring_lock);
+    pthread_mutex_unlock(&ring_lock);
+
+    free(slots);
+    return 0;
+}
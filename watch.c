@@ -0,0 +1,277 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+/* Watch the export for changes made outside the server.
+ *
+ * Every directory under the root gets an inotify watch, and whatever an
+ * event names is forgotten by the caches straight away instead of when
+ * its TTL runs out. The watches are set up by the watcher thread itself,
+ * so a big tree doesn't hold up startup.
+ *
+ * inotify watches are a limited resource. When the kernel won't give us
+ * any more, the directories without one simply fall back to the TTL,
+ * and the report says so. */
+
+enum {
+    WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                 IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK,
+};
+
+int use_watch = 1;
+
+static int watch_fd = -1;
+static char **wd_path;      /* Export path of each watch descriptor */
+static int wd_max;
+static int nwatches;
+static int watch_full;      /* Ran out of watches at some point */
+static int scanned;         /* The initial add_tree is done */
+static unsigned long invalidations, overflows;
+
+static void set_wd(int wd, const char *path) {
+    if(wd >= wd_max) {
+        int n = wd_max ? wd_max * 2 : 256;
+        char **p;
+
+        while(n <= wd)
+            n *= 2;
+        if(!(p = realloc(wd_path, n * sizeof(char *))))
+            return;
+        memset(p + wd_max, 0, (n - wd_max) * sizeof(char *));
+        wd_path = p;
+        wd_max = n;
+    }
+    if(!wd_path[wd])
+        nwatches++;
+    free(wd_path[wd]);
+    wd_path[wd] = strdup(path);
+}
+
+static void clear_wd(int wd) {
+    if(wd < 0 || wd >= wd_max || !wd_path[wd])
+        return;
+    free(wd_path[wd]);
+    wd_path[wd] = nil;
+    nwatches--;
+}
+
+/* Directories still to be watched. Trees can be deep and the watcher
+ * thread's stack small (musl gives it 128 KiB), so add_tree keeps them
+ * here rather than recursing. */
+typedef struct PathStack {
+    char **paths;
+    size_t n, max;
+} PathStack;
+
+static void push(PathStack *s, const char *path) {
+    size_t max;
+    char **p;
+
+    if(s->n == s->max) {
+        max = s->max ? s->max * 2 : 64;
+        if(!(p = realloc(s->paths, max * sizeof(char *))))
+            return;
+        s->paths = p;
+        s->max = max;
+    }
+    if((s->paths[s->n] = strdup(path)))
+        s->n++;
+}
+
+/* Watch the directory at path, and push the directories in it */
+static void add_dir(PathStack *s, const char *path) {
+    char full[PATH_MAX], child[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    int wd, fd;
+
+    if(watch_full)
+        return;
+    if(snprintf(full, sizeof(full), "%s%s", root_path, path) >= (int)sizeof(full))
+        return;
+    wd = inotify_add_watch(watch_fd, full, WATCH_MASK);
+    if(wd < 0) {
+        if(errno == ENOSPC) {
+            watch_full = 1;
+            fprintf(stderr, "Out of inotify watches after %d; the rest of %s relies on the cache TTL\n",
+                    nwatches, root_path);
+        }
+        return;
+    }
+    set_wd(wd, path);
+
+    fd = openat(root_fd, strcmp(path, "/") == 0 ? "." : path + 1,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        return;
+    if(!(dir = fdopendir(fd))) {
+        close(fd);
+        return;
+    }
+    while((de = readdir(dir))) {
+        struct stat st;
+
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if(de->d_type != DT_DIR) {
+            if(de->d_type != DT_UNKNOWN)
+                continue;
+            if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISDIR(st.st_mode))
+                continue;
+        }
+        if(snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path,
+                    de->d_name) < (int)sizeof(child))
+            push(s, child);
+    }
+    closedir(dir);
+}
+
+/* Watch the directory at path and every directory below it */
+static void add_tree(const char *path) {
+    PathStack s = { nil, 0, 0 };
+    char *dir;
+
+    push(&s, path);
+    while(s.n) {
+        dir = s.paths[--s.n];
+        add_dir(&s, dir);
+        free(dir);
+    }
+    free(s.paths);
+}
+
+/* Stop watching path and everything below it, after it moved away */
+static void remove_tree(const char *path) {
+    size_t len = strlen(path);
+    int wd;
+
+    for(wd = 0; wd < wd_max; wd++) {
+        if(wd_path[wd] && strncmp(wd_path[wd], path, len) == 0 &&
+           (wd_path[wd][len] == '\0' || wd_path[wd][len] == '/')) {
+            inotify_rm_watch(watch_fd, wd);
+            clear_wd(wd);
+        }
+    }
+}
+
+/* Something at path changed outside the server */
+static void changed(const char *path, int flags) {
+    md_forget(path, flags);
+    invalidations++;
+}
+
+static void handle(struct inotify_event *ev) {
+    char path[PATH_MAX];
+    const char *dir;
+
+    if(ev->mask & IN_Q_OVERFLOW) {
+        /* Events were lost, so nothing cached can be trusted */
+        overflows++;
+        changed("/", MD_TREE);
+        return;
+    }
+    if(ev->mask & IN_IGNORED) {
+        clear_wd(ev->wd);
+        return;
+    }
+    if(ev->wd < 0 || ev->wd >= wd_max || !(dir = wd_path[ev->wd]))
+        return;
+
+    /* Events on the directory itself */
+    if(!ev->len) {
+        changed(dir, (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ? MD_PARENT | MD_TREE : 0);
+        return;
+    }
+
+    if(snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir,
+                ev->name) >= (int)sizeof(path))
+        return;
+
+    if(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        changed(path, MD_PARENT | MD_TREE);
+        if(ev->mask & IN_ISDIR) {
+            if(ev->mask & IN_MOVED_FROM)
+                remove_tree(path);
+            else if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+                add_tree(path);
+        }
+    } else if(!md_writing(path)) {
+        /* Nothing is cached for a file the server is writing, and it is
+         * forgotten when the last writer closes, so its own writes
+         * needn't each forget it again */
+        changed(path, 0);
+    }
+}
+
+static void *watcher(void *arg) {
+    /* Off the stack, for the same reason as PathStack */
+    static char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    char *p;
+
+    (void)arg;
+    add_tree("/");
+    __atomic_store_n(&scanned, 1, __ATOMIC_RELEASE);
+    if(debug)
+        fprintf(stderr, "Watching %d directories for outside changes\n", nwatches);
+
+    for(;;) {
+        n = read(watch_fd, buf, sizeof(buf));
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "inotify: %s\n", strerror(errno));
+            return nil;
+        }
+        for(p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            handle(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return nil;
+}
+
+/* Start watching the export, if there is a cache to keep coherent */
+int watch_start(void) {
+    pthread_t tid;
+
+    if(!use_watch || !md_active())
+        return 0;
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if(watch_fd < 0)
+        return -1;
+    if(pthread_create(&tid, nil, watcher, nil) != 0) {
+        close(watch_fd);
+        watch_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* Whether every directory in the export is being watched, so that no
+ * outside change can go unnoticed */
+int watch_complete(void) {
+    return watch_fd >= 0 && __atomic_load_n(&scanned, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&watch_full, __ATOMIC_RELAXED);
+}
+
+void watch_report(void) {
+    if(watch_fd < 0)
+        return;
+    fprintf(stderr, "watch: %lu invalidations, %lu overflows, %d directories watched%s\n",
+            __atomic_load_n(&invalidations, __ATOMIC_RELAXED),
+            __atomic_load_n(&overflows, __ATOMIC_RELAXED),
+            __atomic_load_n(&nwatches, __ATOMIC_RELAXED),
+            watch_full ? ", out of watches" : "");
+}
@@ -0,0 +1,347 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Worker pool for the blocking filesystem handlers.
+ *
+ * The event loop hands each request to the pool and goes straight back
+ * to select(), so a slow read on one tag doesn't hold up the others.
+ * Workers respond through ixp_respond as they finish, which libixp
+ * serialises on the connection once ixp_pthread_init has been called.
+ *
+ * Requests on the same fid are ordered with the FidState lock: most
+ * handlers share it and the ones that change the state take it
+ * exclusively. The lock can't keep the state itself alive, though, so
+ * each state also counts the requests handed to the pool for it. A
+ * clunk or remove is parked until that count drains and only then
+ * queued, and anything that arrives for the fid after it is refused.
+ * The state is taken from the fid when the request is submitted, on the
+ * loop, and handed to the handler, which never reads the fid for it: by
+ * the time it runs libixp may have let go of the fid (a hangup), and
+ * then the last request out frees the state. */
+
+typedef struct Work Work;
+struct Work {
+    Ixp9Req *r;
+    void (*fn)(Ixp9Req *, FidState *);
+    FidState *state;  /* Counted in state->queued until it finishes */
+    int lockmode;
+    int running;
+    Ixp9Req *flush;   /* Tflush waiting for this request to finish */
+    Work *next;
+};
+
+enum {
+    FID_NOLOCK,
+    FID_SHARED,
+    FID_EXCLUSIVE,
+    FID_BARRIER,      /* Wait for other requests, then run unlocked */
+};
+
+int nworkers = 0;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static Work *queue_head, *queue_tail;
+static Work *running;
+static Work *parked;    /* Clunks and removes waiting for their fid */
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void run_locked(Work *w) {
+    FidState *state = w->state;
+
+    if(!state || w->lockmode == FID_NOLOCK || w->lockmode == FID_BARRIER) {
+        /* A barrier runs alone, and its handler frees the state */
+        w->fn(w->r, state);
+        return;
+    }
+
+    if(w->lockmode == FID_SHARED)
+        pthread_rwlock_rdlock(&state->lock);
+    else
+        pthread_rwlock_wrlock(&state->lock);
+    w->fn(w->r, state);
+    pthread_rwlock_unlock(&state->lock);
+}
+
+static void enqueue(Work *w) {
+    w->next = nil;
+    if(queue_tail)
+        queue_tail->next = w;
+    else
+        queue_head = w;
+    queue_tail = w;
+    pthread_cond_signal(&work_cond);
+}
+
+static void unlink_work(Work **list, Work *w) {
+    Work **wp;
+
+    for(wp = list; *wp; wp = &(*wp)->next) {
+        if(*wp == w) {
+            *wp = w->next;
+            return;
+        }
+    }
+}
+
+/* w is done with its state. Called with work_lock held; returns a
+ * state nobody else will touch again, for the caller to free. */
+static FidState *done(Work *w) {
+    FidState *state = w->state;
+    Work **wp;
+
+    if(!state || w->lockmode == FID_BARRIER || --state->queued > 0)
+        return nil;
+    pthread_cond_broadcast(&idle_cond);
+    for(wp = &parked; *wp; wp = &(*wp)->next) {
+        if((*wp)->state == state) {
+            w = *wp;
+            *wp = w->next;
+            enqueue(w);
+            return nil;
+        }
+    }
+    return state->freed ? state : nil;
+}
+
+static void *worker(void *arg) {
+    FidState *orphan;
+    Work *w;
+    Ixp9Req *flush;
+
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&work_lock);
+        while(!queue_head)
+            pthread_cond_wait(&work_cond, &work_lock);
+        w = queue_head;
+        queue_head = w->next;
+        if(!queue_head)
+            queue_tail = nil;
+        w->running = 1;
+        w->next = running;
+        running = w;
+        pthread_mutex_unlock(&work_lock);
+
+        run_locked(w);
+
+        pthread_mutex_lock(&work_lock);
+        unlink_work(&running, w);
+        flush = w->flush;
+        orphan = done(w);
+        pthread_mutex_unlock(&work_lock);
+        if(orphan)
+            free_fidstate(orphan);
+
+        /* The flushed request has had its reply; now the Rflush can go.
+         * A write waiting on a group commit hasn't, so its Rflush waits
+         * for that. */
+        if(flush && !dur_flush(flush))
+            ixp_respond(flush, nil);
+        free(w);
+    }
+    return nil;
+}
+
+/* Start n worker threads. With none, requests run inline on the loop. */
+int workers_start(int n) {
+    pthread_t tid;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if(pthread_create(&tid, nil, worker, nil) != 0)
+            break;
+        pthread_detach(tid);
+    }
+    nworkers = i;
+    return i;
+}
+
+/* Whether the fid's clunk or remove has been submitted. If so r has
+ * been answered; if not, its state stays put until the loop returns. */
+static int closing(Ixp9Req *r) {
+    FidState *state;
+    int ret;
+
+    if(nworkers == 0)
+        return 0;
+    pthread_mutex_lock(&work_lock);
+    state = r->fid ? r->fid->aux : nil;
+    ret = state && state->closing;
+    pthread_mutex_unlock(&work_lock);
+    if(ret)
+        ixp_respond(r, "fid is being clunked");
+    return ret;
+}
+
+static void work_submit(Ixp9Req *r, void (*fn)(Ixp9Req *, FidState *), int lockmode) {
+    FidState *state;
+    Work *w;
+
+    if(nworkers == 0) {
+        fn(r, r->fid ? r->fid->aux : nil);
+        return;
+    }
+    w = calloc(1, sizeof(Work));
+
+    pthread_mutex_lock(&work_lock);
+    state = r->fid ? r->fid->aux : nil;
+    if(state && state->closing) {
+        pthread_mutex_unlock(&work_lock);
+        free(w);
+        ixp_respond(r, "fid is being clunked");
+        return;
+    }
+    if(!w) {
+        /* Run it here instead, but still never beside its own clunk */
+        if(state && lockmode == FID_BARRIER) {
+            while(state->queued > 0)
+                pthread_cond_wait(&idle_cond, &work_lock);
+            state->closing = 1;
+        }
+        pthread_mutex_unlock(&work_lock);
+        fn(r, state);
+        return;
+    }
+    w->r = r;
+    w->fn = fn;
+    w->lockmode = lockmode;
+    w->state = state;
+    if(state && lockmode == FID_BARRIER) {
+        state->closing = 1;
+        if(state->queued > 0) {
+            w->next = parked;
+            parked = w;
+            pthread_mutex_unlock(&work_lock);
+            return;
+        }
+    } else if(state)
+        state->queued++;
+    enqueue(w);
+    pthread_mutex_unlock(&work_lock);
+}
+
+/* libixp is finished with f. Its state is freed now, or by the last of
+ * its requests if the connection went away with some still queued. */
+void pool_freefid(IxpFid *f) {
+    FidState *state;
+
+    pthread_mutex_lock(&work_lock);
+    if((state = f->aux)) {
+        f->aux = nil;
+        if(state->queued > 0) {
+            state->freed = 1;
+            state = nil;
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    if(state)
+        free_fidstate(state);
+}
+
+/* The running or parked work for r, if any. Called with work_lock held. */
+static Work *find_waiting(Ixp9Req *r) {
+    Work *w;
+
+    for(w = running; w; w = w->next) {
+        if(w->r == r)
+            return w;
+    }
+    for(w = parked; w; w = w->next) {
+        if(w->r == r)
+            return w;
+    }
+    return nil;
+}
+
+/* Tflush: a queued request is dropped (libixp answers it with an
+ * interrupted error when the Rflush goes out), a running one gets its
+ * Rflush from the worker once it has replied. A clunk or remove always
+ * runs, since the fid is going anyway, and is treated as running. */
+void pool_flush(Ixp9Req *r) {
+    FidState *orphan = nil;
+    Work *w, *prev = nil;
+
+    if(uring_flush(r) || dur_flush(r))
+        return;
+    pthread_mutex_lock(&work_lock);
+    for(w = queue_head; w; prev = w, w = w->next) {
+        if(w->r == r->oldreq && w->lockmode != FID_BARRIER) {
+            if(prev)
+                prev->next = w->next;
+            else
+                queue_head = w->next;
+            if(queue_tail == w)
+                queue_tail = prev;
+            orphan = done(w);
+            free(w);
+            break;
+        }
+    }
+    if(!w) {
+        for(w = queue_head; w && w->r != r->oldreq; w = w->next)
+            ;
+        if((w || (w = find_waiting(r->oldreq))) && !w->flush) {
+            w->flush = r;
+            pthread_mutex_unlock(&work_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&work_lock);
+    if(orphan)
+        free_fidstate(orphan);
+    fs_flush(r);
+}
+
+void pool_walk(Ixp9Req *r) {
+    work_submit(r, fs_walk, r->newfid == r->fid ? FID_EXCLUSIVE : FID_SHARED);
+}
+
+void pool_open(Ixp9Req *r) {
+    work_submit(r, fs_open, FID_EXCLUSIVE);
+}
+
+void pool_read(Ixp9Req *r) {
+    if(closing(r))
+        return;
+    /* Cached contents need neither a worker nor the kernel */
+    if(fc_serve(r) == 0)
+        return;
+    /* Open files go straight to the ring when there is one */
+    if(use_uring && uring_read(r) == 0)
+        return;
+    /* Directory reads move the fid's cursor */
+    work_submit(r, fs_read, (r->fid->qid.type & P9_QTDIR) ? FID_EXCLUSIVE : FID_SHARED);
+}
+
+void pool_write(Ixp9Req *r) {
+    if(closing(r))
+        return;
+    if(use_uring && uring_write(r) == 0)
+        return;
+    work_submit(r, fs_write, FID_SHARED);
+}
+
+void pool_create(Ixp9Req *r) {
+    work_submit(r, fs_create, FID_EXCLUSIVE);
+}
+
+void pool_remove(Ixp9Req *r) {
+    work_submit(r, fs_remove, FID_BARRIER);
+}
+
+void pool_clunk(Ixp9Req *r) {
+    work_submit(r, fs_clunk, FID_BARRIER);
+}
+
+void pool_stat(Ixp9Req *r) {
+    work_submit(r, fs_stat, FID_SHARED);
+}
+
+void pool_wstat(Ixp9Req *r) {
+    work_submit(r, fs_wstat, FID_EXCLUSIVE);
+}
@@ -0,0 +1,360 @@
+#include "server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Write-behind for small writes.
+ *
+ * With wb_size set, every fid opened for writing gets a buffer of that
+ * many bytes. A Twrite that carries on from the end of what is buffered
+ * (or any write, on an append-only fid) is copied in and answered at
+ * once, and the lot goes to the file in one write when the buffer fills,
+ * when a write lands somewhere else, when the fid is read, statted,
+ * wstatted, removed or clunked, or after WB_DELAY ms at the latest.
+ * Writes as big as the buffer go straight to the file, after whatever
+ * is buffered.
+ *
+ * Other fids must see the data too, so buffers are also kept by inode
+ * (a path would miss other links to the file), and anything buffered
+ * for a file is written out before another fid reads it, stats it,
+ * opens it or lists it. While nothing is buffered anywhere that costs
+ * one load.
+ *
+ * A failed write that no request is waiting for is kept and returned
+ * to the next Twrite or Tclunk on the fid, like close() reporting a
+ * failed writeback. */
+
+enum {
+    WB_DELAY = 50,          /* ms data may sit in a buffer */
+    WB_BUCKETS = 64,
+};
+
+struct WriteBuf {
+    pthread_mutex_t lock;
+    int fd;
+    ino_t ino;
+    int append;             /* O_APPEND: offsets don't matter */
+    uint64_t offset;        /* File offset of data[0] */
+    size_t len;
+    int err;                /* errno of a failed background flush */
+    uint64_t since;         /* Monotonic ms the oldest byte came in */
+    WriteBuf *prev, *next;  /* All buffers, for the flusher */
+    WriteBuf *hnext;        /* Hash chain by inode */
+    int users;              /* Other fids flushing it; see wb_sync */
+    char data[];
+};
+
+size_t wb_size = 0;
+
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static WriteBuf bufs = { .prev = &bufs, .next = &bufs };
+static WriteBuf *buckets[WB_BUCKETS];
+static int buffered;        /* Buffers holding data */
+
+static unsigned long merged, flushes, timed;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called with b->lock held. Returns -1 with errno set if the data
+ * couldn't all be written; what is left is dropped either way. */
+static int flush_locked(WriteBuf *b) {
+    size_t done = 0;
+    ssize_t n = 0;
+
+    if(!b->len)
+        return 0;
+    while(done < b->len) {
+        if(b->append)
+            n = write(b->fd, b->data + done, b->len - done);
+        else
+            n = pwrite(b->fd, b->data + done, b->len - done, b->offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    if(n == 0 && done < b->len)
+        errno = ENOSPC;     /* What a short write almost always means */
+    __atomic_add_fetch(&flushes, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&buffered, 1, __ATOMIC_RELEASE);
+    n = done < b->len ? -1 : 0;
+    b->len = 0;
+    return n;
+}
+
+/* Give a fid that was just opened for writing its buffer */
+void wb_open(FidState *state) {
+    struct stat st;
+    WriteBuf *b;
+
+    if(!wb_size || state->wbuf || state->fd < 0 || !(state->open_flags & (O_WRONLY | O_RDWR)))
+        return;
+    if(fstat(state->fd, &st) < 0 || !S_ISREG(st.st_mode) || !(b = malloc(sizeof(WriteBuf) + wb_size)))
+        return;
+    pthread_mutex_init(&b->lock, nil);
+    b->fd = state->fd;
+    b->ino = st.st_ino;
+    b->append = (state->open_flags & O_APPEND) != 0;
+    b->len = 0;
+    b->err = 0;
+    b->users = 0;
+
+    pthread_mutex_lock(&wb_lock);
+    b->next = bufs.next;
+    b->prev = &bufs;
+    bufs.next->prev = b;
+    bufs.next = b;
+    b->hnext = buckets[b->ino % WB_BUCKETS];
+    buckets[b->ino % WB_BUCKETS] = b;
+    pthread_mutex_unlock(&wb_lock);
+    state->wbuf = b;
+}
+
+/* Take a Twrite into the buffer. Returns 1 if it was buffered, 0 if the
+ * caller should write it itself (the buffer has been flushed first), or
+ * -1 with errno set for an error, either from now or left over from an
+ * earlier flush. */
+int wb_write(FidState *state, const char *data, uint32_t count, uint64_t offset) {
+    WriteBuf *b = state->wbuf;
+    int err;
+
+    pthread_mutex_lock(&b->lock);
+    if((err = b->err)) {
+        b->err = 0;
+        pthread_mutex_unlock(&b->lock);
+        errno = err;
+        return -1;
+    }
+    if(b->len && ((!b->append && offset != b->offset + b->len) || count > wb_size - b->len)) {
+        if(flush_locked(b) < 0) {
+            pthread_mutex_unlock(&b->lock);
+            return -1;
+        }
+    }
+    if(count >= wb_size) {
+        pthread_mutex_unlock(&b->lock);
+        return 0;
+    }
+    if(!b->len) {
+        b->offset = offset;
+        b->since = now_ms();
+        __atomic_add_fetch(&buffered, 1, __ATOMIC_RELEASE);
+    } else
+        __atomic_add_fetch(&merged, 1, __ATOMIC_RELAXED);
+    memcpy(b->data + b->len, data, count);
+    b->len += count;
+    pthread_mutex_unlock(&b->lock);
+    return 1;
+}
+
+/* Write out whatever the fid has buffered. Returns -1 with errno set if
+ * that, or an earlier background flush, failed. */
+int wb_flush(FidState *state) {
+    WriteBuf *b = state->wbuf;
+    int ret, err;
+
+    if(!b)
+        return 0;
+    pthread_mutex_lock(&b->lock);
+    ret = flush_locked(b);
+    if(ret == 0 && (err = b->err)) {
+        b->err = 0;
+        errno = err;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+/* Whether any fid has data buffered at all. The loop thread uses this
+ * to leave reads that might need a flush to the workers. */
+int wb_pending(void) {
+    return __atomic_load_n(&buffered, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Buffers picked out under wb_lock, to be flushed once it is let go.
+ * Each has its users raised, so wb_close waits for it until let_go. */
+typedef struct WbHeld {
+    WriteBuf **v;
+    size_t n, max;
+} WbHeld;
+
+/* Called with wb_lock held. Returns -1 if there's no room for b. */
+static int hold(WbHeld *h, WriteBuf *b) {
+    WriteBuf **v;
+    size_t max;
+
+    if(h->n == h->max) {
+        max = h->max ? h->max * 2 : 16;
+        if(!(v = realloc(h->v, max * sizeof(WriteBuf *))))
+            return -1;
+        h->v = v;
+        h->max = max;
+    }
+    b->users++;
+    h->v[h->n++] = b;
+    return 0;
+}
+
+static void let_go(WriteBuf *b) {
+    pthread_mutex_lock(&wb_lock);
+    if(--b->users == 0)
+        pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Write out what b holds, keeping a failure for its fid to report.
+ * Returns 1 if there was anything. */
+static int flush_for_other(WriteBuf *b) {
+    int wrote = 0;
+
+    pthread_mutex_lock(&b->lock);
+    if(b->len) {
+        if(flush_locked(b) < 0 && !b->err)
+            b->err = errno;
+        wrote = 1;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return wrote;
+}
+
+/* Write out what any fid has buffered for the file with inode ino, for
+ * another fid about to look at it. A failure is left for the writing
+ * fid to report. Returns 1 if anything was written. */
+int wb_sync(ino_t ino) {
+    WbHeld h = { nil, 0, 0 };
+    WriteBuf *b;
+    int wrote = 0;
+    size_t i;
+
+    if(!wb_pending())
+        return 0;
+    pthread_mutex_lock(&wb_lock);
+    for(b = buckets[ino % WB_BUCKETS]; b; b = b->hnext) {
+        /* Out of memory to list it, so flush it here instead */
+        if(b->ino == ino && hold(&h, b) < 0)
+            wrote |= flush_for_other(b);
+    }
+    pthread_mutex_unlock(&wb_lock);
+
+    for(i = 0; i < h.n; i++) {
+        wrote |= flush_for_other(h.v[i]);
+        let_go(h.v[i]);
+    }
+    free(h.v);
+    return wrote;
+}
+
+/* st is path as just statted. If it is a file with data buffered by
+ * any fid, write that out and stat it again, past the cache, which may
+ * have had it by another name. Returns -1 with errno set if that fails. */
+int wb_sync_stat(int dirfd, const char *path, struct stat *st) {
+    if(!S_ISREG(st->st_mode) || !wb_sync(st->st_ino))
+        return 0;
+    md_forget(path, 0);
+    return md_stat(dirfd, path, st);
+}
+
+/* Flush and free the fid's buffer before its descriptor is closed. Any
+ * error has nobody left to go to. */
+void wb_close(FidState *state) {
+    WriteBuf *b = state->wbuf, **bp;
+
+    if(!b)
+        return;
+
+    /* Once it is off the lists nobody else can find it, and once its
+     * users have gone nobody else is holding it */
+    pthread_mutex_lock(&wb_lock);
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    for(bp = &buckets[b->ino % WB_BUCKETS]; *bp; bp = &(*bp)->hnext) {
+        if(*bp == b) {
+            *bp = b->hnext;
+            break;
+        }
+    }
+    while(b->users > 0)
+        pthread_cond_wait(&wb_cond, &wb_lock);
+    pthread_mutex_unlock(&wb_lock);
+
+    pthread_mutex_lock(&b->lock);
+    flush_locked(b);
+    pthread_mutex_unlock(&b->lock);
+
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    state->wbuf = nil;
+}
+
+/* Flush buffers that have waited long enough. The buffers are picked
+ * under wb_lock but written without it, so opens and closes elsewhere
+ * don't wait on the disk. A buffer someone is using is left for next
+ * time rather than waited on, as they will flush it themselves if need
+ * be. */
+static void *flusher(void *arg) {
+    struct timespec ts = { 0, WB_DELAY / 2 * 1000000L };
+    WbHeld h = { nil, 0, 0 };
+    WriteBuf *b;
+    uint64_t now;
+    size_t i;
+
+    (void)arg;
+    for(;;) {
+        nanosleep(&ts, nil);
+        if(!wb_pending())
+            continue;
+        now = now_ms();
+        pthread_mutex_lock(&wb_lock);
+        for(b = bufs.next; b != &bufs && hold(&h, b) == 0; b = b->next)
+            ;
+        pthread_mutex_unlock(&wb_lock);
+
+        for(i = 0; i < h.n; i++) {
+            b = h.v[i];
+            if(pthread_mutex_trylock(&b->lock) == 0) {
+                if(b->len && now - b->since >= WB_DELAY) {
+                    if(flush_locked(b) < 0 && !b->err)
+                        b->err = errno;
+                    __atomic_add_fetch(&timed, 1, __ATOMIC_RELAXED);
+                }
+                pthread_mutex_unlock(&b->lock);
+            }
+            let_go(b);
+        }
+        h.n = 0;
+    }
+    return nil;
+}
+
+int wb_start(void) {
+    pthread_t tid;
+
+    if(!wb_size)
+        return 0;
+    if(pthread_create(&tid, nil, flusher, nil) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void wb_report(void) {
+    if(!wb_size)
+        return;
+    fprintf(stderr, "writebuf: %lu writes merged, %lu flushes, %lu by timer, %zu bytes per fid\n",
+            __atomic_load_n(&merged, __ATOMIC_RELAXED),
+            __atomic_load_n(&flushes, __ATOMIC_RELAXED),
+            __atomic_load_n(&timed, __ATOMIC_RELAXED), wb_size);
+}